@@ -0,0 +1,295 @@
+#pragma once
+#include "Future.h"
+#include <vector>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+
+
+namespace Threading {
+
+	// Classes of a DeadlinePool task: a task of a higher class runs before any task of a lower class, whatever the
+	// deadlines; deadlines order the tasks of a class
+	enum class Priority : uint8_t {
+		Critical,
+		High,
+		Normal,
+		Bulk
+	};
+
+	struct TaskOptions {
+		Priority priority{ Priority::Normal };
+		std::chrono::steady_clock::time_point deadline{ std::chrono::steady_clock::time_point::max() };	// none by default
+		bool drop_if_missed{ false };	// discard the task instead of running it late
+	};
+
+	// Passed to the pool's miss handler for each task that starts after its deadline, and set as the exception of the
+	// future of a dropped task
+	class deadline_missed : public std::runtime_error
+	{
+		Priority prio;
+		std::chrono::nanoseconds late;
+		bool was_dropped;
+	public:
+		deadline_missed(Priority p, std::chrono::nanoseconds lateness, bool dropped)
+			: std::runtime_error(std::string(dropped ? "task dropped, deadline missed by " : "task started late, deadline missed by ")
+				+ std::to_string(lateness.count()) + " ns"),
+			prio(p), late(lateness), was_dropped(dropped) {}
+
+		Priority priority() const { return prio; }
+		std::chrono::nanoseconds lateness() const { return late; }
+		bool dropped() const { return was_dropped; }
+	};
+
+	struct DeadlineStats {
+		std::atomic<uint64_t> executed{ 0 };
+		std::atomic<uint64_t> missed{ 0 };			// tasks that started after their deadline, dropped ones included
+		std::atomic<uint64_t> dropped{ 0 };
+		std::atomic<uint64_t> finished_late{ 0 };	// tasks that started in time but finished after their deadline
+		std::atomic<uint64_t> stolen{ 0 };			// tasks run by another worker than the one they were queued on
+		Histogram lateness;							// start time minus deadline, of the missed tasks
+	};
+
+	// SafeThread workers running the most urgent task first: highest priority class, then earliest deadline, then
+	// first posted. Each worker has its own heap; a worker takes the most urgent task among the tops of all heaps,
+	// stealing it if it sits on another worker's heap, so that no urgent task waits behind a busy worker.
+	// A task posted from a worker goes to that worker's heap, other tasks are spread round robin.
+	// A task starting after its deadline is counted and passed to the miss handler, if any, as a deadline_missed, then
+	// run or, with drop_if_missed, discarded. Misses are not crashes: they stay off the exception handler.
+	// A task that throws reaches the exception handler like in a WorkerPool. Destruction runs the tasks already
+	// queued, then joins the workers.
+	class DeadlinePool : public Executor
+	{
+	public:
+		// called on the worker about to run or drop the late task
+		using MissHandler = std::function<void(const deadline_missed&)>;
+
+	private:
+		using clock = std::chrono::steady_clock;
+
+		static constexpr uint64_t no_task = std::numeric_limits<uint64_t>::max();
+		static constexpr int deadline_bits = 56;
+
+		struct Task {
+			uint64_t rank;		// priority class, then deadline
+			uint64_t seq;
+			TaskOptions opts;
+			std::function<void()> fn;
+			std::function<void(std::exception_ptr)> on_drop;
+		};
+
+		struct Later {
+			bool operator()(const Task& a, const Task& b) const {
+				return a.rank != b.rank ? a.rank > b.rank : a.seq > b.seq;
+			}
+		};
+
+		struct alignas(64) Worker {
+			std::mutex mtx;
+			std::vector<Task> heap;
+			std::atomic<uint64_t> top_rank{ no_task };	// rank of the heap top, read without the lock to pick a victim
+			std::unique_ptr<SafeThread> thread;
+		};
+
+		struct Current {
+			DeadlinePool* pool;
+			size_t index;
+		};
+		static inline thread_local Current current{ nullptr, 0 };
+
+		const clock::time_point origin{ clock::now() };
+		MissHandler miss_handler;
+		std::vector<std::unique_ptr<Worker>> workers;
+		std::atomic<size_t> queued{ 0 };
+		std::atomic<uint64_t> next_seq{ 0 };
+		std::atomic<size_t> next_worker{ 0 };
+		Event task_ev;
+		std::atomic<bool> stopping{ false };
+		DeadlineStats pool_stats;
+
+		uint64_t rank_of(const TaskOptions& o) const {
+			uint64_t d = (1ull << deadline_bits) - 1;
+			if (o.deadline != clock::time_point::max())
+				d = std::min<uint64_t>(d, (uint64_t)std::max<int64_t>(0, (o.deadline - origin).count()));
+			return ((uint64_t)o.priority << deadline_bits) | d;
+		}
+
+		void push(Task&& t) {
+			size_t i = (this == current.pool) ? current.index : next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+			Worker& w = *workers[i];
+			{
+				std::unique_lock<std::mutex> lock(w.mtx);
+				w.heap.push_back(std::move(t));
+				std::push_heap(w.heap.begin(), w.heap.end(), Later());
+				w.top_rank.store(w.heap.front().rank, std::memory_order_relaxed);
+			}
+			queued.fetch_add(1, std::memory_order_release);
+			task_ev.set();
+		}
+
+		// takes the most urgent task among the heap tops, false if every heap is empty
+		bool take(Task& t, size_t self) {
+			while (queued.load(std::memory_order_acquire) > 0) {
+				size_t best = self;
+				uint64_t best_rank = workers[self]->top_rank.load(std::memory_order_relaxed);
+				for (size_t i = 0; i < workers.size(); ++i) {
+					uint64_t r = workers[i]->top_rank.load(std::memory_order_relaxed);
+					if (r < best_rank) {
+						best_rank = r;
+						best = i;
+					}
+				}
+				if (no_task == best_rank) {
+					// a push between its heap and the counter
+					std::this_thread::yield();
+					continue;
+				}
+
+				Worker& w = *workers[best];
+				std::unique_lock<std::mutex> lock(w.mtx);
+				if (w.heap.empty())
+					continue;
+				std::pop_heap(w.heap.begin(), w.heap.end(), Later());
+				t = std::move(w.heap.back());
+				w.heap.pop_back();
+				w.top_rank.store(w.heap.empty() ? no_task : w.heap.front().rank, std::memory_order_relaxed);
+				lock.unlock();
+
+				queued.fetch_sub(1, std::memory_order_relaxed);
+				if (best != self)
+					pool_stats.stolen.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+			return false;
+		}
+
+		bool pop(Task& t, size_t self) {
+			while (true) {
+				if (take(t, self)) {
+					// a set() is consumed by a single worker: pass it on while there is work left
+					if (queued.load(std::memory_order_relaxed) > 0)
+						task_ev.set();
+					return true;
+				}
+				if (stopping.load(std::memory_order_acquire)) {
+					task_ev.set();
+					return false;
+				}
+				task_ev.wait();
+			}
+		}
+
+		void report_miss(const Task& task, std::chrono::nanoseconds lateness) {
+			pool_stats.missed.fetch_add(1, std::memory_order_relaxed);
+			pool_stats.lateness.add(lateness);
+			bool drop = task.opts.drop_if_missed;
+			if (drop)
+				pool_stats.dropped.fetch_add(1, std::memory_order_relaxed);
+			if (!miss_handler && !(drop && task.on_drop))
+				return;
+			deadline_missed miss(task.opts.priority, lateness, drop);
+			if (drop && task.on_drop)
+				task.on_drop(std::make_exception_ptr(miss));
+			if (miss_handler)
+				miss_handler(miss);
+		}
+
+		void worker_loop(size_t self) {
+			current = { this, self };
+			Task t;
+			while (pop(t, self)) {
+				bool has_deadline = (t.opts.deadline != clock::time_point::max());
+				auto start = has_deadline ? clock::now() : clock::time_point();
+				if (has_deadline && start > t.opts.deadline) {
+					report_miss(t, std::chrono::duration_cast<std::chrono::nanoseconds>(start - t.opts.deadline));
+					if (t.opts.drop_if_missed) {
+						t = Task();
+						continue;
+					}
+				}
+				t.fn();
+				pool_stats.executed.fetch_add(1, std::memory_order_relaxed);
+				if (has_deadline && start <= t.opts.deadline && clock::now() > t.opts.deadline)
+					pool_stats.finished_late.fetch_add(1, std::memory_order_relaxed);
+				t = Task();
+			}
+		}
+
+		void post_task(std::function<void()> fn, const TaskOptions& opts, std::function<void(std::exception_ptr)> on_drop) {
+			push({ rank_of(opts), next_seq.fetch_add(1, std::memory_order_relaxed), opts, std::move(fn), std::move(on_drop) });
+		}
+
+	public:
+		DeadlinePool(unsigned n = std::thread::hardware_concurrency(),
+			const SafeThread::ExceptionHandler& exh = SafeThread::ExceptionHandler(SafeThread::defaultExHandler),
+			MissHandler on_miss = nullptr)
+			: miss_handler(std::move(on_miss))
+		{
+			n = std::max(n, 1u);
+			for (unsigned i = 0; i < n; ++i)
+				workers.push_back(std::make_unique<Worker>());
+
+			auto user = exh.get();
+			SafeThread::ExceptionHandler worker_handler([user](SafeThread& t, tracked_exception& ex) {
+				if (!fail_running_task(ex.to_exception_ptr()) && user)
+					user(t, ex);
+				// reenter the worker loop
+				return true;
+			});
+			for (unsigned i = 0; i < n; ++i)
+				workers[i]->thread = std::make_unique<SafeThread>(SafeThread::Frozen(true), L"DeadlinePool worker " + std::to_wstring(i),
+					worker_handler, [this, i]() { worker_loop(i); });
+			// every worker must exist before any of them looks at the others
+			for (auto& w : workers)
+				w->thread->unfreeze();
+		}
+
+		~DeadlinePool() {
+			stopping.store(true, std::memory_order_release);
+			task_ev.set();
+			for (auto& w : workers)
+				w->thread.reset();
+		}
+
+		DeadlinePool(const DeadlinePool&) = delete;
+		DeadlinePool& operator=(const DeadlinePool&) = delete;
+
+		// Normal priority, no deadline
+		void post(std::function<void()> task) override {
+			post_task(std::move(task), TaskOptions(), nullptr);
+		}
+
+		void post(std::function<void()> task, const TaskOptions& opts) {
+			post_task(std::move(task), opts, nullptr);
+		}
+
+		// Runs f(args...) under 'opts' and returns the future of its result; a dropped task fails it with deadline_missed
+		template<typename F, typename... Args>
+		auto submit(const TaskOptions& opts, F&& f, Args&&... args)
+		{
+			using R = typename std::invoke_result<typename std::decay<F>::type, typename std::decay<Args>::type&...>::type;
+			Promise<R> p;
+			Future<R> out = p.get_future();
+			auto st = detail::StateAccess::of(p);
+			post_task([p, f = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+					detail::fulfill(p, [&]() -> R { return std::apply(f, t); });
+				}, opts,
+				[st](std::exception_ptr ep) { st->set_exception(std::move(ep)); });
+			return out;
+		}
+
+		size_t size() const {
+			return workers.size();
+		}
+
+		size_t queue_depth() const {
+			return queued.load(std::memory_order_relaxed);
+		}
+
+		const DeadlineStats& stats() const {
+			return pool_stats;
+		}
+	};
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include "SafeThread.h"
+#include "WaitGraph.h"
+#include <functional>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+
+
+namespace Threading {
+
+	// Enables deadlock detection and scans the wait-for graph from a background SafeThread.
+	// Each cycle or long blocked chain is reported once, when it first appears. Threads launched before detection was
+	// enabled are reported by id instead of name until their name is set again.
+	class DeadlockChecker
+	{
+	public:
+		using Report = Deadlock::WaitGraph::Report;
+		using Reporter = std::function<void(const Report&)>;
+
+	private:
+		std::chrono::milliseconds interval;
+		std::chrono::milliseconds long_block;
+		Reporter reporter;
+
+		// not a SingleEvent: the checker must not show up in the graph it scans
+		std::mutex stop_mtx;
+		std::condition_variable stop_cv;
+		bool stop{ false };
+
+		SafeThread thread;
+
+		void loop() {
+			std::vector<std::pair<Report::Kind, std::vector<Deadlock::WaitGraph::Node>>> previous;
+			std::unique_lock<std::mutex> lock(stop_mtx);
+			while (!stop_cv.wait_for(lock, interval, [this]() { return stop; })) {
+				lock.unlock();
+
+				auto reports = Deadlock::WaitGraph::inst().check(long_block);
+				decltype(previous) current;
+				for (auto& r : reports) {
+					current.emplace_back(r.kind, r.chain);
+					if (std::find(previous.begin(), previous.end(), current.back()) == previous.end())
+						reporter(r);
+				}
+				previous = std::move(current);
+
+				lock.lock();
+			}
+		}
+
+	public:
+		static void defaultReporter(const Report& r)
+		{
+			std::wstringstream wss;
+			wss << r.text << std::endl;
+#if defined(_WIN32)
+			OutputDebugStringW(wss.str().c_str());
+#endif
+			fwprintf(stderr, L"%ls", wss.str().c_str());
+			Logger::defprintf(wss.str());
+		}
+
+		DeadlockChecker(std::chrono::milliseconds _interval = std::chrono::milliseconds(500),
+			std::chrono::milliseconds _long_block = std::chrono::seconds(5),
+			Reporter _reporter = defaultReporter)
+			: interval(_interval), long_block(_long_block), reporter(std::move(_reporter))
+		{
+			Deadlock::WaitGraph::enable(true);
+			thread = SafeThread(L"Deadlock checker", [this]() { loop(); });
+		}
+
+		~DeadlockChecker() {
+			{
+				std::unique_lock<std::mutex> lock(stop_mtx);
+				stop = true;
+			}
+			stop_cv.notify_all();
+			thread.join();
+		}
+	};
+}
@@ -1,13 +1,22 @@
 #pragma once
+#if defined(_WIN32)
 #define NOMINMAX
 #include <windows.h>
+#endif
 #include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <unordered_set>
+#include <deque>
 #include <string>
 #include <algorithm>
+#include <vector>
+#include <thread>
+#include <stdexcept>
+#include "Trace.h"
+#include "WaitGraph.h"
+#include "Metrics.h"
 
 
 template <class Duration, class Rep, class Period>
@@ -26,6 +35,28 @@ checked_convert(std::chrono::duration<Rep, Period> d)
 
 class SingleEvent;
 
+// User-space thread that events park instead of blocking its carrier OS thread (see Fiber.h)
+class FiberWaiter
+{
+public:
+	using clock = std::chrono::high_resolution_clock;
+
+	// fiber running on the calling thread, nullptr outside of fibers
+	static FiberWaiter*& current() {
+		static thread_local FiberWaiter* f{ nullptr };
+		return f;
+	}
+
+	// Suspends the calling fiber. 'lock' is released once the fiber is off its stack, and locked again before this
+	// returns. Returns false if 'deadline' (ignored when nullptr) passed first.
+	virtual bool park(std::unique_lock<std::mutex>& lock, const clock::time_point* deadline) = 0;
+	// makes the fiber runnable again if it is parked
+	virtual void unpark() = 0;
+
+protected:
+	virtual ~FiberWaiter() {}
+};
+
 class BinderEvent
 {
 	// use this clock so that all value of duration are accepted (lowest is nano, only used by the high res clock)
@@ -36,6 +67,7 @@ class BinderEvent
 	std::condition_variable cv;
 	std::atomic<bool> event_is_set{ false };
 	std::atomic<SingleEvent*> event_source{ nullptr };
+	FiberWaiter* fiber{ nullptr };	// guarded by mtx
 
 	clock::duration max_wait()
 	{
@@ -45,7 +77,15 @@ class BinderEvent
 public:
 	void wait(SingleEvent** ev_source = nullptr) {
 		std::unique_lock<std::mutex> lock(mtx);
-		cv.wait(lock, [this]() { return (true == event_is_set.load(std::memory_order_acquire)); });
+		if (FiberWaiter* f = FiberWaiter::current()) {
+			while (false == event_is_set.load(std::memory_order_acquire)) {
+				fiber = f;
+				f->park(lock, nullptr);
+			}
+			fiber = nullptr;
+		}
+		else
+			cv.wait(lock, [this]() { return (true == event_is_set.load(std::memory_order_acquire)); });
 		*ev_source = event_source.load(std::memory_order_acquire);
 	};
 
@@ -65,8 +105,18 @@ public:
 		std::unique_lock<std::mutex> lock(mtx);
 		bool pred = false;
 		clock::duration d_wait;
-		while (pred == false && (d_wait = wait_time_no_overflow()).count() > 0)
-			pred = cv.wait_for(lock, d_wait, [this]() {	return (true == event_is_set.load(std::memory_order_acquire)); });
+		if (FiberWaiter* f = FiberWaiter::current()) {
+			auto deadline = clock::now() + wait_time_no_overflow();
+			while (false == (pred = event_is_set.load(std::memory_order_acquire)) && clock::now() < deadline) {
+				fiber = f;
+				f->park(lock, &deadline);
+			}
+			fiber = nullptr;
+		}
+		else {
+			while (pred == false && (d_wait = wait_time_no_overflow()).count() > 0)
+				pred = cv.wait_for(lock, d_wait, [this]() {	return (true == event_is_set.load(std::memory_order_acquire)); });
+		}
 
 		if (true == pred)
 			*ev_source = event_source.load(std::memory_order_acquire);
@@ -78,7 +128,12 @@ public:
 	void set(SingleEvent* source)
 	{
 		event_source.store(source, std::memory_order_release);
-		event_is_set.store(true, std::memory_order_release);
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			event_is_set.store(true, std::memory_order_release);
+			if (fiber)
+				fiber->unpark();
+		}
 		cv.notify_all();
 	};
 };
@@ -95,6 +150,7 @@ protected:
 	std::atomic<bool> event_is_set{ false };
 
 	std::unordered_set<BinderEvent*> bound_events;
+	std::vector<FiberWaiter*> parked;	// guarded by mtx
 
 	void bind_events(BinderEvent* ev)
 	{
@@ -108,37 +164,83 @@ protected:
 		bound_events.erase(ev);
 	};
 
+	// remaining part of the timeout 't' started at 't_start', clamped so that 'now + wait' does not overflow the clock
+	static clock::duration wait_time_no_overflow(clock::time_point t_start, clock::duration t)
+	{
+		auto t_max = clock::time_point::max();
+		auto t_now = clock::now();
+		auto d_elapsed = (t_now - t_start);
+		auto d_wait = (t > d_elapsed) ? (t - d_elapsed) : clock::duration(0);
+		while ((t_max - d_wait).time_since_epoch().count() <= t_now.time_since_epoch().count()) {
+			d_wait /= 2;
+		}
+		return d_wait;
+	}
+
+	// instrumentation, no-ops unless tracing, deadlock detection or metrics are enabled
+	int64_t on_wait_begin() {
+		Tracing::Recorder::record(Tracing::Point::WaitBegin, this);
+		Deadlock::WaitGraph::begin_wait(this, FiberWaiter::current());
+		return Metrics::Registry::on_wait_begin();
+	}
+	void on_wait_end(bool woken, int64_t wait_start) {
+		Deadlock::WaitGraph::end_wait(FiberWaiter::current());
+		Tracing::Recorder::record(woken ? Tracing::Point::WaitWake : Tracing::Point::WaitTimeout, this);
+		Metrics::Registry::on_wait_end(woken, wait_start);
+	}
+	void on_set() {
+		Tracing::Recorder::record(Tracing::Point::EventSet, this);
+		Deadlock::WaitGraph::on_set(this, FiberWaiter::current());
+	}
+
 public:
+	virtual ~SingleEvent() {
+		Deadlock::WaitGraph::forget_event(this);
+	}
 
 	virtual void wait() {
-		std::unique_lock<std::mutex> lock(mtx);
-		cv.wait(lock, [this]() { return (true == event_is_set.load(std::memory_order_acquire)); });
+		int64_t wait_start = on_wait_begin();
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			if (FiberWaiter* f = FiberWaiter::current()) {
+				while (false == event_is_set.load(std::memory_order_acquire)) {
+					parked.push_back(f);
+					f->park(lock, nullptr);
+				}
+			}
+			else
+				cv.wait(lock, [this]() { return (true == event_is_set.load(std::memory_order_acquire)); });
+		}
+		on_wait_end(true, wait_start);
 	};
 
 	virtual bool wait_for(clock::duration t) {
+		int64_t wait_start = on_wait_begin();
 		auto t_start = clock::now();
-		auto wait_time_no_overflow = [&]() {
-			auto t_max = clock::time_point::max();
-			auto t_now = clock::now();
-			auto d_elapsed = (t_now - t_start);
-			auto d_wait = (t > d_elapsed) ? (t - d_elapsed) : clock::duration(0);
-			while ((t_max - d_wait).time_since_epoch().count() <= t_now.time_since_epoch().count()) {
-				d_wait /= 2;
-			}
-			return d_wait;
-		};
-
 		std::unique_lock<std::mutex> lock(mtx);
 		bool pred = false;
 		clock::duration d_wait;
-		while (pred == false && (d_wait = wait_time_no_overflow()).count() > 0)
-			pred = cv.wait_for(lock, d_wait, [this]() {	return (true == event_is_set.load(std::memory_order_acquire)); });
+		if (FiberWaiter* f = FiberWaiter::current()) {
+			auto deadline = clock::now() + wait_time_no_overflow(t_start, t);
+			while (false == (pred = event_is_set.load(std::memory_order_acquire)) && clock::now() < deadline) {
+				parked.push_back(f);
+				if (false == f->park(lock, &deadline))
+					parked.erase(std::remove(parked.begin(), parked.end(), f), parked.end());
+			}
+		}
+		else {
+			while (pred == false && (d_wait = wait_time_no_overflow(t_start, t)).count() > 0)
+				pred = cv.wait_for(lock, d_wait, [this]() {	return (true == event_is_set.load(std::memory_order_acquire)); });
+		}
+		lock.unlock();
 
+		on_wait_end(pred, wait_start);
 		return pred;
 	};
 
-	void set()
+	virtual void set()
 	{
+		on_set();
 		{
 			//mutex here is ok, because bound events will not have other bindings in turn -- no reciprocal binding can occur, thus no dead lock
 			std::unique_lock<std::mutex> lock(boundEv_mtx);
@@ -146,7 +248,14 @@ public:
 				ev->set(this);
 		}
 
-		event_is_set.store(true, std::memory_order_release);
+		{
+			// store under the wait mutex, otherwise a waiter that just evaluated the predicate can miss the notification
+			std::unique_lock<std::mutex> lock(mtx);
+			event_is_set.store(true, std::memory_order_release);
+			for (auto f : parked)
+				f->unpark();
+			parked.clear();
+		}
 		cv.notify_all();
 	};
 
@@ -206,37 +315,152 @@ public:
 	};
 };
 
+// Order in which an auto-reset Event hands a signal to its blocked waiters
+enum class WakePolicy {
+	Fifo,	// longest waiting thread first (fair)
+	Lifo	// most recently blocked thread first (cache-warm, not starvation free)
+};
+
+// Auto-reset event: every set() releases exactly one waiter (or is latched until the next wait if nobody waits).
+// Each waiter blocks on its own condition variable, so a set() never wakes threads that cannot consume the signal.
 class Event : public SingleEvent
 {
+	struct Waiter {
+		std::condition_variable cv;
+		bool signaled{ false };
+		FiberWaiter* fiber{ FiberWaiter::current() };	// parked instead of blocked when not nullptr
+	};
+
+	WakePolicy policy{ WakePolicy::Fifo };
+	std::deque<Waiter*> waiters;	// guarded by mtx
+
+	std::atomic<unsigned long long> n_sets{ 0 };
+	std::atomic<unsigned long long> n_wakeups{ 0 };
+
+	// must be called with mtx held; returns true if the latched signal was consumed
+	bool consume_latched()
+	{
+		if (false == event_is_set.load(std::memory_order_acquire))
+			return false;
+		event_is_set.store(false, std::memory_order_release);
+		return true;
+	}
+
 public:
+	struct WakeStats {
+		unsigned long long sets;	// calls to set()
+		unsigned long long wakeups;	// times a blocked waiter returned from its condition variable, spurious ones included
+	};
+
+	Event(WakePolicy p = WakePolicy::Fifo) : policy(p) {}
+
 	void wait() override {
-		SingleEvent::wait();
-		event_is_set.store(false, std::memory_order_release);
+		int64_t wait_start = on_wait_begin();
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			if (false == consume_latched()) {
+				Waiter w;
+				waiters.push_back(&w);
+				while (false == w.signaled) {
+					if (w.fiber)
+						w.fiber->park(lock, nullptr);
+					else
+						w.cv.wait(lock);
+					n_wakeups.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+		}
+		on_wait_end(true, wait_start);
 	};
 
 	bool wait_for(clock::duration t) override {
-		bool pred = SingleEvent::wait_for(t);
-		event_is_set.store(false, std::memory_order_release);
-		return pred;
+		int64_t wait_start = on_wait_begin();
+		auto t_start = clock::now();
+		std::unique_lock<std::mutex> lock(mtx);
+		if (consume_latched()) {
+			lock.unlock();
+			on_wait_end(true, wait_start);
+			return true;
+		}
+
+		Waiter w;
+		waiters.push_back(&w);
+		clock::duration d_wait;
+		while (false == w.signaled && (d_wait = wait_time_no_overflow(t_start, t)).count() > 0) {
+			if (w.fiber) {
+				auto deadline = clock::now() + d_wait;
+				w.fiber->park(lock, &deadline);
+			}
+			else
+				w.cv.wait_for(lock, d_wait);
+			n_wakeups.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		bool signaled = w.signaled;
+		if (false == signaled)
+			waiters.erase(std::find(waiters.begin(), waiters.end(), &w));
+		lock.unlock();
+
+		on_wait_end(signaled, wait_start);
+		return signaled;
+	};
+
+	void set() override
+	{
+		on_set();
+		n_sets.fetch_add(1, std::memory_order_relaxed);
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			if (!waiters.empty()) {
+				Waiter* w;
+				if (WakePolicy::Fifo == policy) {
+					w = waiters.front();
+					waiters.pop_front();
+				}
+				else {
+					w = waiters.back();
+					waiters.pop_back();
+				}
+				// hand the signal over directly; notify while locked since the waiter owns 'w' on its stack
+				w->signaled = true;
+				if (w->fiber)
+					w->fiber->unpark();
+				else
+					w->cv.notify_one();
+				return;
+			}
+			event_is_set.store(true, std::memory_order_release);
+		}
+
+		// nobody is blocked in wait(): the latched signal goes to whoever consumes it first, including wait_multiple_events
+		std::unique_lock<std::mutex> lock(boundEv_mtx);
+		for (auto ev : bound_events)
+			ev->set(this);
 	};
 
 	bool is_set() override
 	{
-		bool is = (true == event_is_set.load(std::memory_order_acquire));
-		event_is_set.store(false, std::memory_order_release);
-		return is;
+		std::unique_lock<std::mutex> lock(mtx);
+		return consume_latched();
 	};
 
 	void reset() override
 	{
+		std::unique_lock<std::mutex> lock(mtx);
 		event_is_set.store(false, std::memory_order_release);
 	}
+
+	WakeStats wake_stats() const
+	{
+		return { n_sets.load(std::memory_order_relaxed), n_wakeups.load(std::memory_order_relaxed) };
+	}
 };
 
 
 
 
 
+#if defined(_WIN32)
 // wrapper for a windows event
 class SingleWinEvent
 {
@@ -355,4 +579,5 @@ public:
 		if (NULL == hEvent)
 			printError();
 	}
-};
\ No newline at end of file
+};
+#endif
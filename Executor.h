@@ -0,0 +1,324 @@
+#pragma once
+#include "SafeThread.h"
+#include <deque>
+#include <list>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <functional>
+
+
+namespace Threading {
+
+	// Something that runs tasks, now or later, on some thread
+	class Executor
+	{
+		struct RunningTask {
+			void (*fail)(void*, std::exception_ptr);
+			void* ctx;
+		};
+		static inline thread_local RunningTask running{ nullptr, nullptr };
+
+	public:
+		virtual ~Executor() {}
+		virtual void post(std::function<void()> task) = 0;
+
+		// Declares how to fail the result of the task running on this thread if it dies from a fault that skips C++
+		// unwinding ('ctx' must not live on the task's stack). Executors report such faults with fail_running_task().
+		class TaskScope {
+			RunningTask previous;
+		public:
+			TaskScope(void (*fail)(void*, std::exception_ptr), void* ctx) : previous(running) {
+				running = { fail, ctx };
+			}
+			~TaskScope() {
+				running = previous;
+			}
+		};
+
+		// Returns false if the running task did not declare a failure path
+		static bool fail_running_task(std::exception_ptr ep) {
+			RunningTask t = running;
+			running = { nullptr, nullptr };
+			if (nullptr == t.fail)
+				return false;
+			t.fail(t.ctx, ep);
+			return true;
+		}
+	};
+
+	// Runs every task immediately, on the thread posting it
+	class InlineExecutor : public Executor
+	{
+	public:
+		static InlineExecutor& inst() {
+			static InlineExecutor e;
+			return e;
+		}
+		void post(std::function<void()> task) override {
+			task();
+		}
+	};
+
+	// Sizing of an elastic WorkerPool
+	struct ElasticPolicy {
+		unsigned min_workers{ 1 };
+		unsigned max_workers{ std::thread::hardware_concurrency() };
+		size_t grow_queue_depth{ 4 };						// add a worker when more tasks than this wait and no worker is idle,
+		std::chrono::milliseconds grow_task_age{ 10 };		// or when the oldest waiting task waited longer than this
+		std::chrono::milliseconds idle_timeout{ 2000 };		// a worker idle for that long retires, down to min_workers
+	};
+
+	struct PoolStats {
+		std::atomic<unsigned> workers{ 0 };
+		std::atomic<unsigned> idle{ 0 };				// workers waiting for a task
+		std::atomic<unsigned> peak{ 0 };
+		std::atomic<uint64_t> grown_on_depth{ 0 };		// workers added because of the queue depth
+		std::atomic<uint64_t> grown_on_age{ 0 };		// workers added because of the oldest task age
+		std::atomic<uint64_t> retired{ 0 };
+	};
+
+	// SafeThread workers sharing a FIFO queue. A task that throws reaches the pool's exception handler (unless a
+	// TaskScope claims it) and its worker goes on with the next task.
+	// An elastic pool adds workers when tasks pile up or wait too long, and retires idle ones. Scaling has hysteresis:
+	// a worker retires only after idle_timeout without any scaling, so the pool shrinks by at most one worker per
+	// idle_timeout and never right after growing.
+	// Destruction runs the tasks already queued, then joins the workers.
+	class WorkerPool : public Executor
+	{
+		using clock = std::chrono::steady_clock;
+		using Workers = std::list<std::unique_ptr<SafeThread>>;
+
+		struct Queued {
+			std::function<void()> task;
+			clock::time_point at;
+		};
+
+		ElasticPolicy policy;
+		SafeThread::ExceptionHandler worker_handler;
+		PoolStats pool_stats;
+
+		std::mutex q_mtx;
+		std::deque<Queued> tasks;
+		Event task_ev;
+		std::atomic<bool> stopping{ false };
+
+		std::mutex workers_mtx;
+		Workers workers;
+		Workers retired;	// workers that left their loop, joined by the next reap()
+		unsigned next_index{ 0 };
+		clock::time_point last_scaling;
+		std::unique_ptr<SafeThread> supervisor;
+
+		bool elastic() const {
+			return policy.max_workers > policy.min_workers;
+		}
+
+		// call with workers_mtx held
+		void add_worker() {
+			workers.emplace_back();
+			auto self = std::prev(workers.end());
+			*self = std::make_unique<SafeThread>(L"WorkerPool worker " + std::to_wstring(next_index++), worker_handler,
+				[this, self]() { worker_loop(self); });
+			unsigned n = (unsigned)workers.size();
+			pool_stats.workers.store(n, std::memory_order_relaxed);
+			if (n > pool_stats.peak.load(std::memory_order_relaxed))
+				pool_stats.peak.store(n, std::memory_order_relaxed);
+			last_scaling = clock::now();
+		}
+
+		bool try_grow(std::atomic<uint64_t>& reason) {
+			std::unique_lock<std::mutex> lock(workers_mtx);
+			if (stopping.load(std::memory_order_relaxed) || workers.size() >= policy.max_workers)
+				return false;
+			add_worker();
+			reason.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		// with min_workers = 0 the last worker may have retired: a task posted then must not wait for the supervisor
+		void grow_if_empty() {
+			std::unique_lock<std::mutex> lock(workers_mtx);
+			if (stopping.load(std::memory_order_relaxed) || !workers.empty())
+				return;
+			add_worker();
+			pool_stats.grown_on_depth.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// called by an idle worker that timed out, moves its own SafeThread to 'retired'
+		bool try_retire(Workers::iterator self) {
+			std::unique_lock<std::mutex> lock(workers_mtx);
+			auto now = clock::now();
+			if (stopping.load(std::memory_order_relaxed) || workers.size() <= policy.min_workers || now - last_scaling < policy.idle_timeout)
+				return false;
+			// a task posted since the timeout: post() may have seen this worker and not grown the pool
+			if (0 != queue_depth())
+				return false;
+			retired.splice(retired.end(), workers, self);
+			pool_stats.workers.store((unsigned)workers.size(), std::memory_order_relaxed);
+			pool_stats.retired.fetch_add(1, std::memory_order_relaxed);
+			last_scaling = now;
+			return true;
+		}
+
+		void reap() {
+			Workers done;
+			{
+				std::unique_lock<std::mutex> lock(workers_mtx);
+				done.swap(retired);
+			}
+			// joins outside of the lock: a retiring worker may still be on its way out
+			done.clear();
+		}
+
+		// periodic check of the oldest task age, which posting alone cannot notice when every worker is busy
+		void supervise() {
+			reap();
+			bool late = false;
+			{
+				std::unique_lock<std::mutex> lock(q_mtx);
+				late = !tasks.empty() && clock::now() - tasks.front().at > policy.grow_task_age;
+			}
+			if (late && 0 == pool_stats.idle.load(std::memory_order_relaxed))
+				try_grow(pool_stats.grown_on_age);
+		}
+
+		bool pop(std::function<void()>& task, Workers::iterator self) {
+			while (true) {
+				{
+					std::unique_lock<std::mutex> lock(q_mtx);
+					if (!tasks.empty()) {
+						task = std::move(tasks.front().task);
+						tasks.pop_front();
+						bool more = !tasks.empty();
+						lock.unlock();
+						// a set() is consumed by a single worker: pass it on while there is work left
+						if (more)
+							task_ev.set();
+						return true;
+					}
+				}
+				if (stopping.load(std::memory_order_acquire)) {
+					task_ev.set();
+					return false;
+				}
+				pool_stats.idle.fetch_add(1, std::memory_order_relaxed);
+				bool woken = true;
+				if (elastic())
+					woken = task_ev.wait_for(policy.idle_timeout);
+				else
+					task_ev.wait();
+				pool_stats.idle.fetch_sub(1, std::memory_order_relaxed);
+				if (!woken && try_retire(self))
+					return false;
+			}
+		}
+
+		void worker_loop(Workers::iterator self) {
+			std::function<void()> task;
+			while (pop(task, self)) {
+				task();
+				task = nullptr;
+			}
+		}
+
+		static SafeThread::ExceptionHandler make_handler(const SafeThread::ExceptionHandler& exh) {
+			auto user_handler = exh.get();
+			return SafeThread::ExceptionHandler([user_handler](SafeThread& t, tracked_exception& ex) {
+				if (!fail_running_task(ex.to_exception_ptr()) && user_handler)
+					user_handler(t, ex);
+				// reenter the worker loop
+				return true;
+			});
+		}
+
+		void start() {
+			policy.max_workers = std::max(policy.max_workers, 1u);
+			policy.min_workers = std::min(policy.min_workers, policy.max_workers);
+			{
+				std::unique_lock<std::mutex> lock(workers_mtx);
+				for (unsigned i = 0; i < std::max(policy.min_workers, 1u); ++i)
+					add_worker();
+			}
+			if (elastic()) {
+				auto tick = std::chrono::duration_cast<std::chrono::nanoseconds>(std::clamp(policy.grow_task_age / 2,
+					std::chrono::milliseconds(1), std::chrono::milliseconds(100)));
+				supervisor = std::make_unique<SafeThread>(L"WorkerPool supervisor", SafeThread::Periodic({ tick, Overrun::Skip }),
+					[this]() { supervise(); });
+			}
+		}
+
+	public:
+		// Fixed pool of 'n' workers
+		WorkerPool(unsigned n = std::thread::hardware_concurrency(),
+			const SafeThread::ExceptionHandler& exh = SafeThread::ExceptionHandler(SafeThread::defaultExHandler))
+			: worker_handler(make_handler(exh))
+		{
+			n = std::max(n, 1u);
+			policy.min_workers = policy.max_workers = n;
+			start();
+		}
+
+		// Elastic pool, between policy.min_workers (at least one at start) and policy.max_workers
+		WorkerPool(const ElasticPolicy& p,
+			const SafeThread::ExceptionHandler& exh = SafeThread::ExceptionHandler(SafeThread::defaultExHandler))
+			: policy(p), worker_handler(make_handler(exh))
+		{
+			start();
+		}
+
+		~WorkerPool() {
+			supervisor.reset();
+			Workers all;
+			{
+				std::unique_lock<std::mutex> lock(workers_mtx);
+				stopping.store(true, std::memory_order_release);
+				all.swap(workers);
+				all.splice(all.end(), retired);
+			}
+			task_ev.set();
+			all.clear();
+		}
+
+		WorkerPool(const WorkerPool&) = delete;
+		WorkerPool& operator=(const WorkerPool&) = delete;
+
+		void post(std::function<void()> task) override {
+			size_t depth;
+			{
+				std::unique_lock<std::mutex> lock(q_mtx);
+				tasks.push_back({ std::move(task), elastic() ? clock::now() : clock::time_point() });
+				depth = tasks.size();
+			}
+			task_ev.set();
+			if (!elastic())
+				return;
+			if (depth > policy.grow_queue_depth && 0 == pool_stats.idle.load(std::memory_order_relaxed))
+				try_grow(pool_stats.grown_on_depth);
+			else if (0 == policy.min_workers)
+				grow_if_empty();
+		}
+
+		size_t size() const {
+			return pool_stats.workers.load(std::memory_order_relaxed);
+		}
+
+		size_t queue_depth() {
+			std::unique_lock<std::mutex> lock(q_mtx);
+			return tasks.size();
+		}
+
+		// time the oldest queued task has been waiting (always zero for a fixed pool)
+		std::chrono::nanoseconds oldest_task_age() {
+			std::unique_lock<std::mutex> lock(q_mtx);
+			if (tasks.empty() || !elastic())
+				return std::chrono::nanoseconds(0);
+			return clock::now() - tasks.front().at;
+		}
+
+		const PoolStats& stats() const {
+			return pool_stats;
+		}
+	};
+}
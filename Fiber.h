@@ -0,0 +1,579 @@
+#pragma once
+#include "SafeThread.h"
+#include <map>
+#include <deque>
+#include <tuple>
+#include <memory>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <new>
+#if !defined(_WIN32)
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+namespace Threading {
+
+	class FiberScheduler;
+
+	namespace detail {
+
+		struct FiberCarrier;
+
+#if !defined(_WIN32)
+#if defined(__x86_64__)
+		// A switched-out context is its stack pointer, the callee-saved registers and the x87/SSE control words being
+		// saved on its stack. Unlike swapcontext(), a switch makes no syscall to save and restore the signal mask.
+		struct MachineContext {
+			void* sp{ nullptr };
+		};
+
+		// saves the running context to 'from', resumes 'to'
+		__attribute__((naked, noinline)) inline void switch_context(MachineContext* /*from*/, MachineContext* /*to*/) {
+			asm("pushq %rbp\n\t"
+				"pushq %rbx\n\t"
+				"pushq %r12\n\t"
+				"pushq %r13\n\t"
+				"pushq %r14\n\t"
+				"pushq %r15\n\t"
+				"subq $8, %rsp\n\t"
+				"stmxcsr (%rsp)\n\t"
+				"fnstcw 4(%rsp)\n\t"
+				"movq %rsp, (%rdi)\n\t"
+				"movq (%rsi), %rsp\n\t"
+				"ldmxcsr (%rsp)\n\t"
+				"fldcw 4(%rsp)\n\t"
+				"addq $8, %rsp\n\t"
+				"popq %r15\n\t"
+				"popq %r14\n\t"
+				"popq %r13\n\t"
+				"popq %r12\n\t"
+				"popq %rbx\n\t"
+				"popq %rbp\n\t"
+				"ret\n\t");
+		}
+
+		// where the first switch to a new context returns: calls r13(r12), which never returns; the stack ends here
+		__attribute__((naked, noinline)) inline void context_start() {
+			asm(".cfi_undefined %rip\n\t"
+				"movq %r12, %rdi\n\t"
+				"callq *%r13\n\t"
+				"ud2\n\t");
+		}
+
+		// prepares 'c' to run entry(arg) on the given stack, as if it had been switched out right before
+		inline void make_context(MachineContext& c, void* stack, size_t size, void (*entry)(void*), void* arg) {
+			uint64_t* sp = reinterpret_cast<uint64_t*>(((uintptr_t)stack + size) & ~(uintptr_t)15);
+			*--sp = (uint64_t)(uintptr_t)&context_start;	// return address
+			*--sp = 0;									// rbp
+			*--sp = 0;									// rbx
+			*--sp = (uint64_t)(uintptr_t)arg;			// r12
+			*--sp = (uint64_t)(uintptr_t)entry;			// r13
+			*--sp = 0;									// r14
+			*--sp = 0;									// r15
+			*--sp = 0x0000037F00001F80ull;				// default MXCSR, then default x87 control word
+			c.sp = sp;
+		}
+#else
+		// other architectures: swapcontext(), which also switches the signal mask
+		struct MachineContext {
+			ucontext_t uc;
+		};
+
+		inline void switch_context(MachineContext* from, MachineContext* to) {
+			swapcontext(&from->uc, &to->uc);
+		}
+
+		inline void context_start(unsigned entry_hi, unsigned entry_lo, unsigned arg_hi, unsigned arg_lo) {
+			auto entry = reinterpret_cast<void (*)(void*)>((uintptr_t)(((uint64_t)entry_hi << 32) | entry_lo));
+			entry(reinterpret_cast<void*>((uintptr_t)(((uint64_t)arg_hi << 32) | arg_lo)));
+		}
+
+		inline void make_context(MachineContext& c, void* stack, size_t size, void (*entry)(void*), void* arg) {
+			getcontext(&c.uc);
+			c.uc.uc_stack.ss_sp = stack;
+			c.uc.uc_stack.ss_size = size;
+			c.uc.uc_link = nullptr;
+			uint64_t e = (uint64_t)(uintptr_t)entry, a = (uint64_t)(uintptr_t)arg;
+			makecontext(&c.uc, (void (*)())&context_start, 4, (unsigned)(e >> 32), (unsigned)(e & 0xffffffffu),
+				(unsigned)(a >> 32), (unsigned)(a & 0xffffffffu));
+		}
+#endif
+
+		// Fiber stacks of one size, recycled; each has a guard page below it so that an overflow faults instead of
+		// corrupting the neighbouring stack
+		class FiberStackPool
+		{
+			static constexpr size_t max_pooled = 1024;
+
+			size_t page;
+			size_t size;
+			std::mutex mtx;
+			std::vector<void*> free_stacks;
+
+		public:
+			FiberStackPool(size_t stack_size) : page((size_t)sysconf(_SC_PAGESIZE)) {
+				size = (std::max<size_t>(stack_size, 4 * page) + page - 1) / page * page;
+			}
+			~FiberStackPool() {
+				for (void* mem : free_stacks)
+					munmap(mem, size + page);
+			}
+
+			// base of the mapping: the guard page, the stack is the 'size' bytes above it
+			void* acquire() {
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					if (!free_stacks.empty()) {
+						void* mem = free_stacks.back();
+						free_stacks.pop_back();
+						return mem;
+					}
+				}
+				void* mem = mmap(nullptr, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (MAP_FAILED == mem)
+					throw std::bad_alloc();
+				mprotect(mem, page, PROT_NONE);
+				return mem;
+			}
+			void release(void* mem) {
+				std::unique_lock<std::mutex> lock(mtx);
+				if (free_stacks.size() < max_pooled)
+					free_stacks.push_back(mem);
+				else
+					munmap(mem, size + page);
+			}
+
+			size_t guard_size() const { return page; }
+			size_t stack_size() const { return size; }
+		};
+#endif
+	}
+
+	// User-space thread run by a FiberScheduler on one of its carrier SafeThreads. Waiting on a SingleEvent, an Event or
+	// wait_multiple_events from a fiber parks the fiber and lets the carrier run others.
+	// Like a SafeThread, a fiber has a name and an exception handler, which can ask to reenter the fiber function.
+	class Fiber : public FiberWaiter, public std::enable_shared_from_this<Fiber>
+	{
+		friend class FiberScheduler;
+		friend struct detail::FiberCarrier;
+
+	public:
+		using ExHnd = std::function<bool(Fiber&, tracked_exception&)>;
+		using ExceptionHandler = NamedType<ExHnd, struct FiberExceptionHandlerTag>;
+
+	private:
+		enum State : int { Ready, Running, Parked, Done };
+		enum class Switch { Yield, Park, Exit };
+
+		detail::FiberCarrier* carrier;
+		std::wstring name{ L"unnamed fiber" };
+		ExHnd exception_handler{ defaultExHandler };
+		std::function<void()> body;
+		std::atomic<int> state{ Ready };
+		bool timed_out{ false };
+		bool has_timer{ false };
+		std::multimap<clock::time_point, std::shared_ptr<Fiber>>::iterator timer;
+		SingleEvent done;
+		Rcu::Domain::FiberReader rcu_reader;
+		std::shared_ptr<Fiber> self;	// keeps the fiber alive until it finishes
+
+#if defined(_WIN32)
+		void* os_fiber{ nullptr };
+
+		static void WINAPI entry(void* p) {
+			Fiber* f = static_cast<Fiber*>(p);
+			f->run_body();
+			f->switch_out(Switch::Exit);
+		}
+#else
+		detail::MachineContext ctx;
+		void* stack{ nullptr };
+		SafeThread::FaultScope* fault_scope{ nullptr };	// innermost try_catch_wrapper of the fiber while switched out
+
+		static void entry(void* p) {
+			Fiber* f = static_cast<Fiber*>(p);
+			f->run_body();
+			f->switch_out(Switch::Exit);
+		}
+#endif
+
+		Fiber(detail::FiberCarrier* c) : carrier(c) {}
+
+		template<typename... Args>
+		void setup(const ExceptionHandler& exh, Args&&... args) {
+			exception_handler = exh.get();
+			setup(std::forward<Args>(args)...);
+		}
+
+		template<typename Str,
+			typename = typename std::enable_if<is_string<Str>::type::value>::type,
+			typename... Args>
+		void setup(Str&& _name, Args&&... args) {
+			name = SafeThread::s2ws(std::forward<Str>(_name));
+			setup(std::forward<Args>(args)...);
+		}
+
+		template<typename F, typename... Args,
+			typename = typename std::enable_if<_is_invocable<F, Args...>::value>::type>
+		void setup(F&& f, Args&&... args) {
+			body = [f = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable { std::apply(f, t); };
+		}
+
+		void run_body() {
+			// a node of the wait-for graph of its own, not its carrier's
+			Deadlock::WaitGraph::set_fiber_name(static_cast<FiberWaiter*>(this), name);
+			bool reenter;
+			do {
+				reenter = false;
+				SafeThread::try_catch_wrapper(
+					[this]() { body(); },
+					[&](tracked_exception& ex) {
+						Tracing::Recorder::record(Tracing::Point::Exception, this);
+						// a fault skips the destructors of the snapshots held by the abandoned frames
+						Rcu::Domain::abandon_reads();
+						Metrics::Registry::on_exception();
+						auto temp = exception_handler;
+						reenter = temp(*this, ex);
+						if (reenter) {
+							Tracing::Recorder::record(Tracing::Point::Reenter, this);
+							Metrics::Registry::on_restart();
+						}
+					});
+			} while (reenter);
+			// gives back the read slot of the fiber, if it took one
+			Rcu::Domain::unregister_thread();
+			Deadlock::WaitGraph::forget_fiber(static_cast<FiberWaiter*>(this));
+		}
+
+		// from the fiber: back to the carrier, which acts on 'why'
+		void switch_out(Switch why);
+		// from the carrier: runs the fiber until it switches out
+		void resume();
+
+	public:
+		static bool defaultExHandler(Fiber& f, tracked_exception& ex)
+		{
+			std::wstringstream wss;
+			wss << L"Fiber \"" << f.name << L"\" encountered exception " << SafeThread::s2ws(ex.what()) << std::endl;
+#if defined(_WIN32)
+			if (ex.getExceptionPointers()) {
+				Stackwalk::StackWalker::passPrettyTrace([&](const std::string& trce) {
+					wss << L"Stack trace: " << std::endl << SafeThread::s2ws(trce) << std::endl;
+				}, ex.getExceptionPointers()->ContextRecord);
+			}
+			OutputDebugStringW(wss.str().c_str());
+#else
+			if (ExceptionInfo* info = ex.getExceptionPointers()) {
+				wss << L"Fault address: " << info->info.si_addr << std::endl << L"Stack trace: " << std::endl;
+				char** symbols = backtrace_symbols(info->frames, info->n_frames);
+				for (int i = 0; symbols && i < info->n_frames; ++i)
+					wss << SafeThread::s2ws(symbols[i]) << std::endl;
+				free(symbols);
+			}
+#endif
+			fwprintf(stderr, L"%ls", wss.str().c_str());
+			Logger::defprintf(wss.str());
+
+			return false;
+		}
+
+		// fiber running on the calling thread, nullptr outside of fibers
+		static Fiber* current() {
+			return static_cast<Fiber*>(FiberWaiter::current());
+		}
+
+		// Lets the other ready fibers of the carrier run; a thread yield outside of fibers
+		static void yield();
+		// Parks the calling fiber for 'd'; a thread sleep outside of fibers
+		static void sleep_for(clock::duration d);
+
+		const std::wstring& getName() const {
+			return name;
+		}
+
+		// Waits for the fiber function to return for good; parks when called from a fiber
+		void join() {
+			done.wait();
+		}
+		bool is_done() {
+			return done.is_set();
+		}
+
+		bool park(std::unique_lock<std::mutex>& lock, const clock::time_point* deadline) override;
+		void unpark() override;
+	};
+
+	namespace detail {
+
+		// An OS thread running fibers. A fiber stays on the carrier it was spawned on, so that the thread_local state
+		// of the code it runs never changes under its feet.
+		struct FiberCarrier {
+			using clock = FiberWaiter::clock;
+
+			std::mutex mtx;
+			std::deque<std::shared_ptr<Fiber>> ready;
+			std::multimap<clock::time_point, std::shared_ptr<Fiber>> timers;	// parked fibers with a deadline
+			size_t live{ 0 };
+			bool stopping{ false };
+			Event wake;
+
+			// set by the fiber switching out, for the carrier to act on once off the fiber's stack
+			Fiber::Switch reason{ Fiber::Switch::Yield };
+			std::unique_lock<std::mutex>* park_lock{ nullptr };
+			const clock::time_point* park_deadline{ nullptr };
+
+#if defined(_WIN32)
+			void* os_fiber{ nullptr };
+#else
+			MachineContext ctx;
+#endif
+			std::unique_ptr<SafeThread> thread;
+		};
+	}
+
+	// Runs many fibers on a few carrier SafeThreads. Fiber stacks are small and pooled (on POSIX; Windows fibers own
+	// their stacks), so a fiber costs a few pages where a SafeThread costs a full OS thread.
+	// Destruction waits until every fiber has finished.
+	class FiberScheduler
+	{
+		using clock = FiberWaiter::clock;
+
+#if !defined(_WIN32)
+		detail::FiberStackPool stacks;
+#endif
+		size_t stack_size;
+		std::vector<std::unique_ptr<detail::FiberCarrier>> carriers;
+		std::atomic<size_t> next_carrier{ 0 };
+
+		void run_carrier(detail::FiberCarrier& c) {
+#if defined(_WIN32)
+			c.os_fiber = ConvertThreadToFiber(nullptr);
+#endif
+			while (true) {
+				std::shared_ptr<Fiber> f;
+				clock::duration idle = clock::duration::max();
+				{
+					std::unique_lock<std::mutex> lock(c.mtx);
+					auto now = clock::now();
+					while (!c.timers.empty() && c.timers.begin()->first <= now) {
+						auto expired = std::move(c.timers.begin()->second);
+						c.timers.erase(c.timers.begin());
+						expired->has_timer = false;
+						int expected = Fiber::Parked;
+						if (expired->state.compare_exchange_strong(expected, Fiber::Ready)) {
+							expired->timed_out = true;
+							c.ready.push_back(std::move(expired));
+						}
+					}
+					if (!c.ready.empty()) {
+						f = std::move(c.ready.front());
+						c.ready.pop_front();
+						if (f->has_timer) {
+							c.timers.erase(f->timer);
+							f->has_timer = false;
+						}
+					}
+					else if (c.stopping && 0 == c.live)
+						break;
+					else if (!c.timers.empty())
+						idle = c.timers.begin()->first - now;
+				}
+
+				if (!f) {
+					if (clock::duration::max() == idle)
+						c.wake.wait();
+					else
+						c.wake.wait_for(idle);
+					continue;
+				}
+
+				f->resume();
+
+				switch (c.reason) {
+				case Fiber::Switch::Yield: {
+					f->state.store(Fiber::Ready, std::memory_order_release);
+					std::unique_lock<std::mutex> lock(c.mtx);
+					c.ready.push_back(std::move(f));
+					break;
+				}
+				case Fiber::Switch::Park:
+					// the fiber is off its stack: from now on it can be unparked, by whoever holds the lock it parked with
+					f->state.store(Fiber::Parked, std::memory_order_release);
+					if (c.park_deadline) {
+						std::unique_lock<std::mutex> lock(c.mtx);
+						f->timer = c.timers.emplace(*c.park_deadline, f);
+						f->has_timer = true;
+					}
+					c.park_lock->unlock();
+					break;
+				case Fiber::Switch::Exit:
+					f->state.store(Fiber::Done, std::memory_order_release);
+#if defined(_WIN32)
+					DeleteFiber(f->os_fiber);
+#else
+					stacks.release(f->stack);
+					f->stack = nullptr;
+#endif
+					f->body = nullptr;
+					{
+						std::unique_lock<std::mutex> lock(c.mtx);
+						--c.live;
+					}
+					f->done.set();
+					f->self.reset();
+					break;
+				}
+			}
+#if defined(_WIN32)
+			ConvertFiberToThread();
+#endif
+		}
+
+	public:
+		FiberScheduler(unsigned n_carriers = std::thread::hardware_concurrency(), size_t _stack_size = 64 * 1024)
+#if !defined(_WIN32)
+			: stacks(_stack_size), stack_size(stacks.stack_size())
+#else
+			: stack_size(_stack_size)
+#endif
+		{
+			n_carriers = std::max(n_carriers, 1u);
+			for (unsigned i = 0; i < n_carriers; ++i)
+				carriers.push_back(std::make_unique<detail::FiberCarrier>());
+			for (unsigned i = 0; i < n_carriers; ++i) {
+				detail::FiberCarrier* c = carriers[i].get();
+				c->thread = std::make_unique<SafeThread>(L"FiberScheduler carrier " + std::to_wstring(i), [this, c]() { run_carrier(*c); });
+			}
+		}
+
+		~FiberScheduler() {
+			for (auto& c : carriers) {
+				{
+					std::unique_lock<std::mutex> lock(c->mtx);
+					c->stopping = true;
+				}
+				c->wake.set();
+			}
+			for (auto& c : carriers)
+				c->thread.reset();
+		}
+
+		FiberScheduler(const FiberScheduler&) = delete;
+		FiberScheduler& operator=(const FiberScheduler&) = delete;
+
+		// Starts a fiber; takes the same optional name and exception handler (Fiber::ExceptionHandler) as SafeThread,
+		// then the callable and its arguments
+		template<typename... Args>
+		std::shared_ptr<Fiber> spawn(Args&&... args)
+		{
+			detail::FiberCarrier* c = carriers[next_carrier.fetch_add(1, std::memory_order_relaxed) % carriers.size()].get();
+			std::shared_ptr<Fiber> f(new Fiber(c));
+			f->setup(std::forward<Args>(args)...);
+
+#if defined(_WIN32)
+			f->os_fiber = CreateFiberEx(0, stack_size, FIBER_FLAG_FLOAT_SWITCH, &Fiber::entry, f.get());
+			if (nullptr == f->os_fiber)
+				throw std::bad_alloc();
+#else
+			f->stack = stacks.acquire();
+			detail::make_context(f->ctx, static_cast<char*>(f->stack) + stacks.guard_size(), stacks.stack_size(), &Fiber::entry, f.get());
+#endif
+			f->self = f;
+
+			{
+				std::unique_lock<std::mutex> lock(c->mtx);
+				++c->live;
+				c->ready.push_back(f);
+			}
+			c->wake.set();
+			return f;
+		}
+
+		// fibers started and not finished yet
+		size_t live() {
+			size_t n = 0;
+			for (auto& c : carriers) {
+				std::unique_lock<std::mutex> lock(c->mtx);
+				n += c->live;
+			}
+			return n;
+		}
+
+		size_t carrier_count() const {
+			return carriers.size();
+		}
+	};
+
+
+	inline void Fiber::switch_out(Switch why) {
+		carrier->reason = why;
+#if defined(_WIN32)
+		SwitchToFiber(carrier->os_fiber);
+#else
+		detail::switch_context(&ctx, &carrier->ctx);
+#endif
+	}
+
+	inline void Fiber::resume() {
+		state.store(Running, std::memory_order_relaxed);
+		FiberWaiter::current() = this;
+		Rcu::Domain::FiberReader* carrier_reader = Rcu::Domain::switch_reader(&rcu_reader);
+#if defined(_WIN32)
+		SwitchToFiber(os_fiber);
+#else
+		// each fiber has its own chain of try_catch_wrapper scopes for the fault handler to jump back to
+		SafeThread::FaultScope* carrier_scope = SafeThread::FaultScope::current;
+		SafeThread::FaultScope::current = fault_scope;
+		detail::switch_context(&carrier->ctx, &ctx);
+		fault_scope = SafeThread::FaultScope::current;
+		SafeThread::FaultScope::current = carrier_scope;
+#endif
+		Rcu::Domain::switch_reader(carrier_reader);
+		FiberWaiter::current() = nullptr;
+	}
+
+	inline bool Fiber::park(std::unique_lock<std::mutex>& lock, const clock::time_point* deadline) {
+		carrier->park_lock = &lock;
+		carrier->park_deadline = deadline;
+		timed_out = false;
+		switch_out(Switch::Park);
+		lock.lock();
+		return !timed_out;
+	}
+
+	inline void Fiber::unpark() {
+		int expected = Parked;
+		if (!state.compare_exchange_strong(expected, Ready))
+			return;
+		{
+			std::unique_lock<std::mutex> lock(carrier->mtx);
+			carrier->ready.push_back(shared_from_this());
+		}
+		carrier->wake.set();
+	}
+
+	inline void Fiber::yield() {
+		if (Fiber* f = current())
+			f->switch_out(Switch::Yield);
+		else
+			std::this_thread::yield();
+	}
+
+	inline void Fiber::sleep_for(clock::duration d) {
+		Fiber* f = current();
+		if (nullptr == f) {
+			std::this_thread::sleep_for(d);
+			return;
+		}
+		// nobody else knows this mutex: only the deadline unparks
+		std::mutex mtx;
+		std::unique_lock<std::mutex> lock(mtx);
+		auto deadline = clock::now() + d;
+		while (clock::now() < deadline)
+			f->park(lock, &deadline);
+	}
+}
@@ -0,0 +1,339 @@
+#pragma once
+#include "Executor.h"
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include <stdexcept>
+
+
+namespace Threading {
+
+	template<typename T> class Future;
+	template<typename T> class Promise;
+
+	namespace detail {
+
+		// lets the free functions below reach the shared state of promises and futures
+		struct StateAccess {
+			template<typename H>
+			static auto& of(H& h) { return h.state; }
+		};
+
+		// Result slot shared by a Promise and its Futures. Readiness is an atomic flag, so polling and continuations
+		// never block; the SingleEvent is only used by threads that choose to wait.
+		template<typename T>
+		class FutureState
+		{
+			using Storage = typename std::conditional<std::is_void<T>::value, char, T>::type;
+
+			std::atomic<bool> ready{ false };
+			std::mutex mtx;
+			SingleEvent ready_ev;
+			std::vector<std::function<void()>> continuations;
+
+			template<typename Fill>
+			bool complete(Fill fill) {
+				std::vector<std::function<void()>> to_run;
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					if (ready.load(std::memory_order_relaxed))
+						return false;
+					fill();
+					ready.store(true, std::memory_order_release);
+					to_run.swap(continuations);
+				}
+				ready_ev.set();
+				for (auto& c : to_run)
+					c();
+				return true;
+			}
+
+		public:
+			std::optional<Storage> value;
+			std::exception_ptr error;
+
+			template<typename... V>
+			bool set_value(V&&... v) {
+				return complete([&]() { value.emplace(std::forward<V>(v)...); });
+			}
+			bool set_exception(std::exception_ptr ep) {
+				return complete([&]() { error = std::move(ep); });
+			}
+
+			// failure path for Executor::TaskScope
+			static void fail(void* self, std::exception_ptr ep) {
+				static_cast<FutureState*>(self)->set_exception(std::move(ep));
+			}
+
+			bool is_ready() const {
+				return ready.load(std::memory_order_acquire);
+			}
+			void wait() {
+				if (!is_ready())
+					ready_ev.wait();
+			}
+			bool wait_for(std::chrono::high_resolution_clock::duration t) {
+				return is_ready() || ready_ev.wait_for(t);
+			}
+
+			// runs 'c' when the state completes, right away if it already did
+			void on_ready(std::function<void()> c) {
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					if (!ready.load(std::memory_order_relaxed)) {
+						continuations.push_back(std::move(c));
+						return;
+					}
+				}
+				c();
+			}
+		};
+
+		template<typename T>
+		struct get_result { using type = const T&; };
+		template<>
+		struct get_result<void> { using type = void; };
+
+		template<typename T, typename F>
+		struct continuation_result { using type = typename std::invoke_result<F, const T&>::type; };
+		template<typename F>
+		struct continuation_result<void, F> { using type = typename std::invoke_result<F>::type; };
+
+		// completes 'p' with the result of 'g', or with whatever 'g' throws, including faults reported by an executor
+		template<typename R, typename G>
+		void fulfill(Promise<R>& p, G&& g) {
+			auto& st = StateAccess::of(p);
+			Executor::TaskScope scope(&FutureState<R>::fail, st.get());
+			try {
+				if constexpr (std::is_void<R>::value) {
+					g();
+					st->set_value();
+				}
+				else
+					st->set_value(g());
+			}
+			catch (...) {
+				st->set_exception(std::current_exception());
+			}
+		}
+	}
+
+	template<typename T>
+	class Promise
+	{
+		std::shared_ptr<detail::FutureState<T>> state{ std::make_shared<detail::FutureState<T>>() };
+
+		friend struct detail::StateAccess;
+
+	public:
+		Future<T> get_future() const {
+			return Future<T>(state);
+		}
+
+		template<typename... V>
+		void set_value(V&&... v) {
+			if (!state->set_value(std::forward<V>(v)...))
+				throw std::logic_error("Promise already satisfied");
+		}
+
+		void set_exception(std::exception_ptr ep) {
+			if (!state->set_exception(std::move(ep)))
+				throw std::logic_error("Promise already satisfied");
+		}
+	};
+
+	// Shared handle on a result that completes once. Copies observe the same result.
+	template<typename T>
+	class Future
+	{
+		std::shared_ptr<detail::FutureState<T>> state;
+
+		template<typename> friend class Promise;
+		friend struct detail::StateAccess;
+
+		Future(std::shared_ptr<detail::FutureState<T>> s) : state(std::move(s)) {}
+
+	public:
+		Future() {}
+
+		bool valid() const {
+			return (nullptr != state);
+		}
+		bool is_ready() const {
+			return state->is_ready();
+		}
+		bool has_exception() const {
+			return state->is_ready() && state->error;
+		}
+
+		void wait() const {
+			state->wait();
+		}
+		bool wait_for(std::chrono::high_resolution_clock::duration t) const {
+			return state->wait_for(t);
+		}
+
+		// Blocks until the result is there; rethrows the exception of a failed future
+		typename detail::get_result<T>::type get() const {
+			state->wait();
+			if (state->error)
+				std::rethrow_exception(state->error);
+			if constexpr (!std::is_void<T>::value)
+				return *state->value;
+		}
+
+		// Once this future succeeds, runs f(value) (f() for Future<void>) on 'ex' and completes the returned future with
+		// its result. A failure skips f and is passed on. 'ex' must outlive the continuation.
+		template<typename F>
+		auto then(Executor& ex, F f) const -> Future<typename detail::continuation_result<T, F>::type>
+		{
+			using R = typename detail::continuation_result<T, F>::type;
+			Promise<R> p;
+			Future<R> out = p.get_future();
+			auto st = state;
+			Executor* exp = &ex;
+			st->on_ready([st, p, f, exp]() mutable {
+				exp->post([st, p, f]() mutable {
+					if (st->error) {
+						p.set_exception(st->error);
+						return;
+					}
+					detail::fulfill(p, [&]() -> R {
+						if constexpr (std::is_void<T>::value)
+							return f();
+						else
+							return f(*st->value);
+					});
+				});
+			});
+			return out;
+		}
+
+		// Same, running f on the thread completing this future
+		template<typename F>
+		auto then(F f) const {
+			return then(InlineExecutor::inst(), std::move(f));
+		}
+	};
+
+	// Completes with every value, in order, once all the futures succeeded; fails as soon as one of them fails
+	template<typename T>
+	Future<std::vector<T>> when_all(const std::vector<Future<T>>& futures)
+	{
+		struct Join {
+			std::atomic<size_t> remaining;
+			std::vector<Future<T>> inputs;
+			Promise<std::vector<T>> p;
+		};
+		auto join = std::make_shared<Join>();
+		join->remaining.store(futures.size());
+		join->inputs = futures;
+		Future<std::vector<T>> out = join->p.get_future();
+		if (futures.empty()) {
+			join->p.set_value();
+			return out;
+		}
+
+		for (auto& f : futures) {
+			auto st = detail::StateAccess::of(f);
+			st->on_ready([join, st]() {
+				auto& out_st = detail::StateAccess::of(join->p);
+				if (st->error)
+					out_st->set_exception(st->error);
+				else if (1 == join->remaining.fetch_sub(1, std::memory_order_acq_rel)) {
+					std::vector<T> values;
+					values.reserve(join->inputs.size());
+					for (auto& in : join->inputs)
+						values.push_back(*detail::StateAccess::of(in)->value);
+					out_st->set_value(std::move(values));
+				}
+			});
+		}
+		return out;
+	}
+
+	inline Future<void> when_all(const std::vector<Future<void>>& futures)
+	{
+		struct Join {
+			std::atomic<size_t> remaining;
+			Promise<void> p;
+		};
+		auto join = std::make_shared<Join>();
+		join->remaining.store(futures.size());
+		Future<void> out = join->p.get_future();
+		if (futures.empty()) {
+			join->p.set_value();
+			return out;
+		}
+
+		for (auto& f : futures) {
+			auto st = detail::StateAccess::of(f);
+			st->on_ready([join, st]() {
+				auto& out_st = detail::StateAccess::of(join->p);
+				if (st->error)
+					out_st->set_exception(st->error);
+				else if (1 == join->remaining.fetch_sub(1, std::memory_order_acq_rel))
+					out_st->set_value();
+			});
+		}
+		return out;
+	}
+
+	// Completes with the index of the first future to complete, whether it succeeded or failed
+	template<typename T>
+	Future<size_t> when_any(const std::vector<Future<T>>& futures)
+	{
+		Promise<size_t> p;
+		Future<size_t> out = p.get_future();
+		if (futures.empty()) {
+			p.set_exception(std::make_exception_ptr(std::invalid_argument("when_any of no future")));
+			return out;
+		}
+		auto out_st = detail::StateAccess::of(p);
+		for (size_t i = 0; i < futures.size(); ++i)
+			detail::StateAccess::of(futures[i])->on_ready([out_st, i]() { out_st->set_value(i); });
+		return out;
+	}
+
+	// Runs f(args...) on 'ex' and returns the future of its result
+	template<typename F, typename... Args>
+	auto async(Executor& ex, F&& f, Args&&... args)
+	{
+		using R = typename std::invoke_result<typename std::decay<F>::type, typename std::decay<Args>::type&...>::type;
+		Promise<R> p;
+		Future<R> out = p.get_future();
+		ex.post([p, f = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+			detail::fulfill(p, [&]() -> R { return std::apply(f, t); });
+		});
+		return out;
+	}
+
+	// Launches f(args...) on 't' and returns the future of its result; throws std::logic_error if 't' is still joinable,
+	// since replacing a joinable thread terminates the process.
+	// Whatever try_catch_wrapper catches, C++ exception or fault, fails the future instead of reaching an exception handler.
+	template<typename F, typename... Args>
+	auto async(SafeThread& t, F&& f, Args&&... args)
+	{
+		if (t.joinable())
+			throw std::logic_error("async: the SafeThread is still joinable, join it first");
+		using R = typename std::invoke_result<typename std::decay<F>::type, typename std::decay<Args>::type&...>::type;
+		Promise<R> p;
+		Future<R> out = p.get_future();
+		auto st = detail::StateAccess::of(p);
+		t = SafeThread(
+			SafeThread::ExceptionHandler([st](SafeThread&, tracked_exception& ex) {
+				st->set_exception(ex.to_exception_ptr());
+				return false;
+			}),
+			[st, f = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+				if constexpr (std::is_void<R>::value) {
+					std::apply(f, t);
+					st->set_value();
+				}
+				else
+					st->set_value(std::apply(f, t));
+			});
+		return out;
+	}
+}
@@ -0,0 +1,142 @@
+#pragma once
+#include "Event.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+
+
+// Single writer, single reader mailbox holding only the newest value of a T (sensor readings, quotes...), over a
+// triple buffer: the writer fills its own slot and swaps it with the middle one, the reader swaps the middle one
+// with its own slot when it is newer. publish() and refresh() are one atomic exchange each, without locks: a slow
+// reader never stalls the writer and never sees a value being written; values it did not get to are overwritten.
+// The reader can block in wait(), or on changed() through SingleEvent::wait_multiple_events after prepare_wait().
+// Blocking is announced with a flag checked by the writer after a fence, as in the pipeline rings: the writer only
+// takes the event's lock to wake a reader that sleeps.
+template<typename T>
+class latest_value {
+
+	static constexpr uint8_t index_mask = 3;
+	static constexpr uint8_t fresh = 4;		// the middle slot holds a value the reader has not taken
+
+	struct alignas(64) Slot {
+		T value;
+	};
+
+	Slot slots[3];
+	alignas(64) std::atomic<uint8_t> middle{ 1 };
+	struct alignas(64) {
+		uint8_t back{ 2 };
+		std::atomic<uint64_t> written{ 0 };
+	} w;
+	struct alignas(64) {
+		uint8_t front{ 0 };
+		std::atomic<uint64_t> consumed{ 0 };
+		std::atomic<bool> sleeping{ false };
+	} r;
+	Event changed_ev;
+
+	static void bump(std::atomic<uint64_t>& counter) {
+		counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	void swap_back() {
+		uint8_t previous = middle.exchange(w.back | fresh, std::memory_order_acq_rel);
+		w.back = previous & index_mask;
+		bump(w.written);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		// one set() per sleep
+		if (r.sleeping.load(std::memory_order_relaxed) && r.sleeping.exchange(false, std::memory_order_relaxed))
+			changed_ev.set();
+	}
+
+public:
+	explicit latest_value(const T& initial = T()) : slots{ { initial }, { initial }, { initial } } {}
+
+	latest_value(const latest_value&) = delete;
+	latest_value& operator=(const latest_value&) = delete;
+
+	// Writer side
+
+	void publish(const T& v) {
+		slots[w.back].value = v;
+		swap_back();
+	}
+	void publish(T&& v) {
+		slots[w.back].value = std::move(v);
+		swap_back();
+	}
+	// Builds the value in place with f(T&), for values too big to copy twice. The slot holds an older value, not the
+	// last one published.
+	template<typename F>
+	void publish_with(F&& f) {
+		f(slots[w.back].value);
+		swap_back();
+	}
+
+	// Reader side
+
+	// Takes the newest value if there is one the reader has not seen; true if so
+	bool refresh() {
+		if (0 == (middle.load(std::memory_order_relaxed) & fresh))
+			return false;
+		uint8_t previous = middle.exchange(r.front, std::memory_order_acq_rel);
+		r.front = previous & index_mask;
+		bump(r.consumed);
+		return true;
+	}
+
+	// The value taken by the last refresh(), valid until the next one
+	const T& value() const {
+		return slots[r.front].value;
+	}
+
+	// Announces that the reader is about to block on changed(), so that the next publish() sets it; false if a value
+	// is already there to refresh() instead
+	bool prepare_wait() {
+		r.sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (0 == (middle.load(std::memory_order_relaxed) & fresh))
+			return true;
+		r.sleeping.store(false, std::memory_order_relaxed);
+		return false;
+	}
+
+	// Blocks until a value newer than value() is published, then takes it
+	const T& wait() {
+		while (!refresh()) {
+			if (prepare_wait())
+				changed_ev.wait();
+			r.sleeping.store(false, std::memory_order_relaxed);
+		}
+		return value();
+	}
+
+	// Same, false if nothing was published within 't'
+	bool wait_for(std::chrono::high_resolution_clock::duration t) {
+		auto deadline = std::chrono::high_resolution_clock::now() + t;
+		while (true) {
+			if (refresh())
+				return true;
+			auto now = std::chrono::high_resolution_clock::now();
+			bool woken = (now < deadline) && (!prepare_wait() || changed_ev.wait_for(deadline - now));
+			r.sleeping.store(false, std::memory_order_relaxed);
+			if (!woken)
+				return refresh();
+		}
+	}
+
+	// Set by the first publish() after prepare_wait() returned true; wait on it, or with wait_multiple_events, then
+	// refresh(), which may find nothing after a stale signal
+	Event& changed() {
+		return changed_ev;
+	}
+
+	// Values published, and values the reader took; the difference were overwritten before being read
+	uint64_t written() const {
+		return w.written.load(std::memory_order_relaxed);
+	}
+	uint64_t consumed() const {
+		return r.consumed.load(std::memory_order_relaxed);
+	}
+};
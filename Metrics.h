@@ -0,0 +1,456 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <ostream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+
+namespace Metrics {
+
+	class Registry;
+
+	// Monotonic count, e.g. requests served
+	class Counter
+	{
+		friend class Registry;
+		size_t cell{ 0 };
+		explicit Counter(size_t c) : cell(c) {}
+	public:
+		Counter() = delete;
+		void inc(uint64_t n = 1) const;
+		uint64_t value() const;
+	};
+
+	// Value going up and down, e.g. items in flight. Each thread adds its own share, the value is their sum.
+	class Gauge
+	{
+		friend class Registry;
+		size_t cell{ 0 };
+		explicit Gauge(size_t c) : cell(c) {}
+	public:
+		Gauge() = delete;
+		void add(int64_t n = 1) const;
+		void sub(int64_t n = 1) const { add(-n); }
+		int64_t value() const;
+	};
+
+	// Distribution over fixed buckets: observe(v) counts v in the first bucket whose upper bound is >= v
+	class Histogram
+	{
+		friend class Registry;
+		size_t cell{ 0 };	// one cell per bound, then the +Inf bucket, then the sum
+		std::shared_ptr<const std::vector<double>> bounds;
+		Histogram(size_t c, std::shared_ptr<const std::vector<double>> b) : cell(c), bounds(std::move(b)) {}
+	public:
+		Histogram() = delete;
+		void observe(double v) const;
+		uint64_t count() const;
+		double sum() const;
+	};
+
+	// Process wide set of metrics. Every thread updates its own shard, without locks or atomic read-modify-write;
+	// a scrape sums the shards of the live threads and what the exited ones left.
+	// A thread gets its shard on its first update; SafeThreads fold theirs into the totals when they exit.
+	// The built-in metrics of the library (threads, exceptions, event waits) are disabled by default, in which case each
+	// hook is a relaxed load. User metrics are always updated.
+	class Registry
+	{
+		static constexpr size_t chunk_cells = 512;
+		static constexpr size_t max_chunks = 128;
+
+		// cells of one thread, allocated by chunks so that registering a metric never moves them
+		struct Shard {
+			std::atomic<std::atomic<uint64_t>*> chunks[max_chunks]{};
+
+			~Shard() {
+				for (auto& c : chunks)
+					delete[] c.load(std::memory_order_relaxed);
+			}
+
+			// owner thread only
+			std::atomic<uint64_t>& at(size_t i) {
+				std::atomic<uint64_t>* c = chunks[i / chunk_cells].load(std::memory_order_relaxed);
+				if (nullptr == c) {
+					c = new std::atomic<uint64_t>[chunk_cells];
+					for (size_t k = 0; k < chunk_cells; ++k)
+						c[k].store(0, std::memory_order_relaxed);
+					chunks[i / chunk_cells].store(c, std::memory_order_release);
+				}
+				return c[i % chunk_cells];
+			}
+
+			uint64_t read(size_t i) const {
+				std::atomic<uint64_t>* c = chunks[i / chunk_cells].load(std::memory_order_acquire);
+				return c ? c[i % chunk_cells].load(std::memory_order_relaxed) : 0;
+			}
+		};
+
+		struct ThreadShard {
+			Shard* shard{ nullptr };
+			bool counted{ false };	// counted in threads_running
+			~ThreadShard() {
+				if (shard)
+					inst().release(*this);
+			}
+		};
+		static ThreadShard& thread_shard() {
+			static thread_local ThreadShard s;
+			return s;
+		}
+
+		enum class Kind { Counter, Gauge, Histogram };
+
+		struct Series {
+			Kind kind;
+			std::string name;
+			std::string help;
+			std::string labels;
+			size_t cell;
+			std::shared_ptr<const std::vector<double>> bounds;
+		};
+
+		static inline std::atomic<bool> enabled{ false };
+
+		std::mutex mtx;
+		std::vector<Series> series;
+		std::vector<Shard*> shards;
+		std::vector<uint64_t> retired;		// what exited threads left, per cell
+		std::vector<bool> is_double;		// cells holding the bits of a double (histogram sums)
+		size_t next_cell{ 0 };
+
+		struct Builtin;
+		std::unique_ptr<Builtin> builtin;
+
+		Registry();
+
+		Shard& this_shard() {
+			ThreadShard& ts = thread_shard();
+			if (nullptr == ts.shard) {
+				ts.shard = new Shard;
+				std::unique_lock<std::mutex> lock(mtx);
+				shards.push_back(ts.shard);
+			}
+			return *ts.shard;
+		}
+
+		static uint64_t add_cell(uint64_t a, uint64_t b, bool as_double) {
+			if (!as_double)
+				return a + b;
+			double x, y;
+			std::memcpy(&x, &a, sizeof(x));
+			std::memcpy(&y, &b, sizeof(y));
+			x += y;
+			std::memcpy(&a, &x, sizeof(a));
+			return a;
+		}
+
+		void release(ThreadShard& ts) {
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				for (size_t i = 0; i < next_cell; ++i)
+					retired[i] = add_cell(retired[i], ts.shard->read(i), is_double[i]);
+				shards.erase(std::find(shards.begin(), shards.end(), ts.shard));
+			}
+			delete ts.shard;
+			ts.shard = nullptr;
+			ts.counted = false;
+		}
+
+		// sum of 'cell' over every shard, call with mtx held
+		uint64_t total(size_t cell) {
+			uint64_t v = retired[cell];
+			for (Shard* s : shards)
+				v = add_cell(v, s->read(cell), is_double[cell]);
+			return v;
+		}
+
+		size_t add_series(Kind kind, const std::string& name, const std::string& help, const std::string& labels,
+			size_t cells, std::shared_ptr<const std::vector<double>> bounds)
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			for (auto& s : series) {
+				if (s.name == name && s.labels == labels) {
+					if (s.kind != kind || (bounds && *bounds != *s.bounds))
+						throw std::invalid_argument("metric " + name + " already registered with another type");
+					return s.cell;
+				}
+			}
+			if (next_cell + cells > chunk_cells * max_chunks)
+				throw std::length_error("too many metrics");
+			size_t cell = next_cell;
+			next_cell += cells;
+			retired.resize(next_cell, 0);
+			is_double.resize(next_cell, false);
+			if (Kind::Histogram == kind)
+				is_double[next_cell - 1] = true;
+			series.push_back({ kind, name, help, labels, cell, std::move(bounds) });
+			return cell;
+		}
+
+		// shortest of %.15g and %.17g that reads back as 'v'
+		static std::string format_value(double v) {
+			char buf[32];
+			std::snprintf(buf, sizeof(buf), "%.15g", v);
+			if (std::strtod(buf, nullptr) != v)
+				std::snprintf(buf, sizeof(buf), "%.17g", v);
+			return buf;
+		}
+
+		static std::string with_labels(const std::string& labels, const std::string& extra = std::string()) {
+			if (labels.empty() && extra.empty())
+				return std::string();
+			if (labels.empty() || extra.empty())
+				return "{" + labels + extra + "}";
+			return "{" + labels + "," + extra + "}";
+		}
+
+		friend class Counter;
+		friend class Gauge;
+		friend class Histogram;
+
+		// the calling thread's cell 'i'
+		static std::atomic<uint64_t>& cell(size_t i) {
+			return inst().this_shard().at(i);
+		}
+
+		// single writer: a load and a store
+		static void bump(std::atomic<uint64_t>& c, uint64_t n) {
+			c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+
+	public:
+		static Registry& inst() {
+			static Registry r;
+			return r;
+		}
+
+		~Registry();
+
+		// built-in metrics of the library
+		static void enable(bool on = true) {
+			enabled.store(on, std::memory_order_relaxed);
+		}
+		static bool is_enabled() {
+			return enabled.load(std::memory_order_relaxed);
+		}
+
+		// Registering an existing name with the same labels returns the existing metric.
+		// 'labels' is the inside of the Prometheus label set, e.g. "pool=\"io\",stage=\"parse\"".
+		Counter counter(const std::string& name, const std::string& help, const std::string& labels = std::string()) {
+			return Counter(add_series(Kind::Counter, name, help, labels, 1, nullptr));
+		}
+		Gauge gauge(const std::string& name, const std::string& help, const std::string& labels = std::string()) {
+			return Gauge(add_series(Kind::Gauge, name, help, labels, 1, nullptr));
+		}
+		// 'bounds' are the bucket upper bounds, in increasing order
+		Histogram histogram(const std::string& name, const std::string& help, std::vector<double> bounds,
+			const std::string& labels = std::string())
+		{
+			std::sort(bounds.begin(), bounds.end());
+			auto b = std::make_shared<const std::vector<double>>(std::move(bounds));
+			size_t cell = add_series(Kind::Histogram, name, help, labels, b->size() + 2, b);
+			std::unique_lock<std::mutex> lock(mtx);
+			for (auto& s : series)
+				if (s.cell == cell)
+					return Histogram(cell, s.bounds);
+			return Histogram(cell, b);
+		}
+
+		// Takes the calling thread's shard now rather than on its first update
+		static void register_thread() {
+			inst().this_shard();
+		}
+		// Folds the calling thread's shard into the totals; SafeThreads call it when they exit
+		static void unregister_thread() {
+			ThreadShard& ts = thread_shard();
+			if (ts.shard)
+				inst().release(ts);
+		}
+
+		// Hooks of the built-in metrics
+		static void on_thread_start();
+		static void on_thread_exit();
+		static void on_exception();
+		static void on_restart();
+		// returns the start of the wait, 0 when disabled
+		static int64_t on_wait_begin() {
+			if (!is_enabled())
+				return 0;
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+		static void on_wait_end(bool woken, int64_t start_ns);
+
+		// Prometheus text exposition format (version 0.0.4), series of one name grouped under a single HELP and TYPE
+		void write_prometheus(std::ostream& os) {
+			std::vector<Series> snapshot;
+			std::vector<uint64_t> values;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				snapshot = series;
+				values.resize(next_cell);
+				for (size_t i = 0; i < next_cell; ++i)
+					values[i] = total(i);
+			}
+			std::stable_sort(snapshot.begin(), snapshot.end(), [](const Series& a, const Series& b) { return a.name < b.name; });
+
+			for (size_t i = 0; i < snapshot.size(); ++i) {
+				const Series& s = snapshot[i];
+				if (0 == i || snapshot[i - 1].name != s.name) {
+					static const char* types[] = { "counter", "gauge", "histogram" };
+					os << "# HELP " << s.name << ' ' << s.help << '\n';
+					os << "# TYPE " << s.name << ' ' << types[(int)s.kind] << '\n';
+				}
+				switch (s.kind) {
+				case Kind::Counter:
+					os << s.name << with_labels(s.labels) << ' ' << values[s.cell] << '\n';
+					break;
+				case Kind::Gauge:
+					os << s.name << with_labels(s.labels) << ' ' << (int64_t)values[s.cell] << '\n';
+					break;
+				case Kind::Histogram: {
+					uint64_t acc = 0;
+					for (size_t b = 0; b < s.bounds->size(); ++b) {
+						acc += values[s.cell + b];
+						os << s.name << "_bucket" << with_labels(s.labels, "le=\"" + format_value((*s.bounds)[b]) + "\"") << ' ' << acc << '\n';
+					}
+					acc += values[s.cell + s.bounds->size()];
+					os << s.name << "_bucket" << with_labels(s.labels, "le=\"+Inf\"") << ' ' << acc << '\n';
+					double sum;
+					std::memcpy(&sum, &values[s.cell + s.bounds->size() + 1], sizeof(sum));
+					os << s.name << "_sum" << with_labels(s.labels) << ' ' << format_value(sum) << '\n';
+					os << s.name << "_count" << with_labels(s.labels) << ' ' << acc << '\n';
+					break;
+				}
+				}
+			}
+		}
+	};
+
+	struct Registry::Builtin {
+		Counter threads_started;
+		Counter threads_exited;
+		Gauge threads_running;
+		Counter exceptions;
+		Counter restarts;
+		Counter waits;
+		Counter wait_timeouts;
+		Histogram wait_seconds;
+
+		Builtin(Registry& r)
+			: threads_started(r.counter("safethread_threads_started_total", "SafeThreads started"))
+			, threads_exited(r.counter("safethread_threads_exited_total", "SafeThreads exited"))
+			, threads_running(r.gauge("safethread_threads_running", "SafeThreads running"))
+			, exceptions(r.counter("safethread_exceptions_total", "Exceptions and faults caught in SafeThreads and fibers"))
+			, restarts(r.counter("safethread_restarts_total", "SafeThreads and fibers reentered by their exception handler"))
+			, waits(r.counter("event_waits_total", "Waits on events"))
+			, wait_timeouts(r.counter("event_wait_timeouts_total", "Waits on events that timed out"))
+			, wait_seconds(r.histogram("event_wait_seconds", "Time spent waiting on events",
+				{ 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10 }))
+		{}
+	};
+
+	inline Registry::Registry() {
+		builtin = std::make_unique<Builtin>(*this);
+	}
+
+	inline Registry::~Registry() {
+		for (Shard* s : shards)
+			delete s;
+	}
+
+	inline void Registry::on_thread_start() {
+		// no shard yet: a thread that never updates a metric never takes the registry lock
+		if (!is_enabled())
+			return;
+		Builtin& b = *inst().builtin;
+		b.threads_started.inc();
+		b.threads_running.add(1);
+		thread_shard().counted = true;
+	}
+
+	inline void Registry::on_thread_exit() {
+		ThreadShard& ts = thread_shard();
+		if (ts.counted) {
+			Builtin& b = *inst().builtin;
+			b.threads_exited.inc();
+			b.threads_running.sub(1);
+		}
+		unregister_thread();
+	}
+
+	inline void Registry::on_exception() {
+		if (is_enabled())
+			inst().builtin->exceptions.inc();
+	}
+
+	inline void Registry::on_restart() {
+		if (is_enabled())
+			inst().builtin->restarts.inc();
+	}
+
+	inline void Registry::on_wait_end(bool woken, int64_t start_ns) {
+		if (0 == start_ns)
+			return;
+		int64_t end_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		Builtin& b = *inst().builtin;
+		b.waits.inc();
+		if (!woken)
+			b.wait_timeouts.inc();
+		b.wait_seconds.observe((end_ns - start_ns) * 1e-9);
+	}
+
+	inline void Counter::inc(uint64_t n) const {
+		Registry::bump(Registry::cell(cell), n);
+	}
+	inline uint64_t Counter::value() const {
+		Registry& r = Registry::inst();
+		std::unique_lock<std::mutex> lock(r.mtx);
+		return r.total(cell);
+	}
+
+	inline void Gauge::add(int64_t n) const {
+		Registry::bump(Registry::cell(cell), (uint64_t)n);
+	}
+	inline int64_t Gauge::value() const {
+		Registry& r = Registry::inst();
+		std::unique_lock<std::mutex> lock(r.mtx);
+		return (int64_t)r.total(cell);
+	}
+
+	inline void Histogram::observe(double v) const {
+		size_t b = std::lower_bound(bounds->begin(), bounds->end(), v) - bounds->begin();
+		Registry::bump(Registry::cell(cell + b), 1);
+		std::atomic<uint64_t>& s = Registry::cell(cell + bounds->size() + 1);
+		uint64_t bits = s.load(std::memory_order_relaxed);
+		double sum;
+		std::memcpy(&sum, &bits, sizeof(sum));
+		sum += v;
+		std::memcpy(&bits, &sum, sizeof(bits));
+		s.store(bits, std::memory_order_relaxed);
+	}
+	inline uint64_t Histogram::count() const {
+		Registry& r = Registry::inst();
+		std::unique_lock<std::mutex> lock(r.mtx);
+		uint64_t n = 0;
+		for (size_t b = 0; b <= bounds->size(); ++b)
+			n += r.total(cell + b);
+		return n;
+	}
+	inline double Histogram::sum() const {
+		Registry& r = Registry::inst();
+		std::unique_lock<std::mutex> lock(r.mtx);
+		uint64_t bits = r.total(cell + bounds->size() + 1);
+		double s;
+		std::memcpy(&s, &bits, sizeof(s));
+		return s;
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "SafeThread.h"
+#include "Metrics.h"
+#include <fstream>
+#include <cstdio>
+#include <string>
+
+
+namespace Threading {
+
+	// Writes the metrics registry in Prometheus text format to 'path' every 'interval' from a background SafeThread,
+	// and once more when destroyed. The file is written next to 'path' then renamed over it, so that a reader such as
+	// the node_exporter textfile collector never sees a partial dump.
+	class MetricsDumper
+	{
+		std::string path;
+		std::atomic<uint64_t> n_failures{ 0 };
+		SafeThread thread;
+
+	public:
+		MetricsDumper(std::string _path, std::chrono::milliseconds interval = std::chrono::seconds(10),
+			bool builtin_metrics = true)
+			: path(std::move(_path))
+		{
+			if (builtin_metrics)
+				Metrics::Registry::enable(true);
+			thread = SafeThread(L"Metrics dumper", SafeThread::Periodic({ interval, Overrun::Skip }), [this]() {
+				if (!dump())
+					n_failures.fetch_add(1, std::memory_order_relaxed);
+			});
+		}
+
+		~MetricsDumper() {
+			thread.stop_periodic();
+			thread.join();
+			dump();
+		}
+
+		// writes the file now; false if it could not be written
+		bool dump() {
+			std::string tmp = path + ".tmp";
+			{
+				std::ofstream f(tmp, std::ios::out | std::ios::trunc);
+				if (!f)
+					return false;
+				Metrics::Registry::inst().write_prometheus(f);
+				f.flush();
+				if (!f)
+					return false;
+			}
+#if defined(_WIN32)
+			// rename() does not replace an existing file on Windows
+			std::remove(path.c_str());
+#endif
+			return 0 == std::rename(tmp.c_str(), path.c_str());
+		}
+
+		// periodic dumps that failed
+		uint64_t failures() const {
+			return n_failures.load(std::memory_order_relaxed);
+		}
+	};
+}
@@ -0,0 +1,205 @@
+#pragma once
+#include "Executor.h"
+#include <vector>
+#include <memory>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <mutex>
+#include <condition_variable>
+
+
+namespace Threading {
+
+	// Thrown by the parallel algorithms when several chunks failed; a single failure is rethrown as is
+	class aggregate_exception : public std::runtime_error
+	{
+		std::vector<std::exception_ptr> errors;
+	public:
+		explicit aggregate_exception(std::vector<std::exception_ptr> _errors)
+			: std::runtime_error(std::to_string(_errors.size()) + " parallel chunks failed"), errors(std::move(_errors)) {}
+
+		// every exception, C++ exception or fault, in the order they were caught
+		const std::vector<std::exception_ptr>& exceptions() const {
+			return errors;
+		}
+	};
+
+	namespace detail {
+
+		// Workers shared by every parallel algorithm, started on first use. Never destroyed: joining them at exit
+		// would race with the destruction of the statics their threads use (Rcu domain, metrics...).
+		inline WorkerPool& parallel_pool() {
+			static WorkerPool* pool = new WorkerPool(std::thread::hardware_concurrency());
+			return *pool;
+		}
+
+		// set on the workers of parallel_pool()
+		inline bool& in_parallel_worker() {
+			thread_local bool flag = false;
+			return flag;
+		}
+
+		// Progress and failures of one for_chunks call, shared with its helper tasks
+		struct ChunkJob {
+			std::mutex mtx;
+			std::condition_variable done_cv;
+			size_t running{ 0 };	// helpers not done yet
+			std::vector<std::exception_ptr> errors;
+			std::atomic<bool> failed{ false };
+
+			void record(std::exception_ptr ep) {
+				std::unique_lock<std::mutex> lock(mtx);
+				errors.push_back(std::move(ep));
+				failed.store(true, std::memory_order_release);
+			}
+			void done() {
+				std::unique_lock<std::mutex> lock(mtx);
+				if (0 == --running)
+					done_cv.notify_all();
+			}
+			void wait() {
+				std::unique_lock<std::mutex> lock(mtx);
+				done_cv.wait(lock, [this]() { return 0 == running; });
+			}
+			// a helper stopped by a fault, reported by the pool
+			static void fail(void* ctx, std::exception_ptr ep) {
+				ChunkJob* job = static_cast<ChunkJob*>(ctx);
+				job->record(std::move(ep));
+				job->done();
+			}
+		};
+
+		// Splits [0, n) in chunks of 'grain' items claimed dynamically by helper tasks on parallel_pool(), so faster
+		// workers take more chunks; the caller waits for them. A call made from a helper (nested algorithm) runs its
+		// chunks inline instead, which cannot deadlock on a pool busy with its callers.
+		// The first exception thrown by 'body' (or fault caught by the pool) stops the distribution of further chunks.
+		// Every exception is kept: once the helpers are done, a single one is rethrown as is, several of them in an
+		// aggregate_exception.
+		template<typename Body>
+		void for_chunks(size_t n, size_t grain, Body&& body)
+		{
+			if (0 == n)
+				return;
+
+			WorkerPool& pool = parallel_pool();
+			size_t workers = std::max<size_t>(1, pool.size());
+			if (0 == grain)
+				grain = std::max<size_t>(1, n / (workers * 8));
+			workers = std::min(workers, (n + grain - 1) / grain);
+
+			std::atomic<size_t> next{ 0 };
+			auto job = std::make_shared<ChunkJob>();
+
+			auto work = [&]() {
+				try {
+					size_t b;
+					while (!job->failed.load(std::memory_order_acquire) && (b = next.fetch_add(grain, std::memory_order_relaxed)) < n)
+						body(b, std::min(n, b + grain));
+				}
+				catch (...) {
+					job->record(std::current_exception());
+				}
+			};
+
+			if (in_parallel_worker()) {
+				// a fault here belongs to the enclosing helper
+				work();
+			}
+			else {
+				job->running = workers;
+				for (size_t i = 0; i < workers; ++i) {
+					pool.post([job, &work]() {
+						in_parallel_worker() = true;
+						// a fault skips the end of this task: the pool hands it to ChunkJob::fail instead
+						Executor::TaskScope scope(&ChunkJob::fail, job.get());
+						work();
+						job->done();
+					});
+				}
+				job->wait();
+			}
+
+			if (1 == job->errors.size())
+				std::rethrow_exception(job->errors.front());
+			if (!job->errors.empty())
+				throw aggregate_exception(std::move(job->errors));
+		}
+	}
+
+	// Calls f(i) for every i in [first, last)
+	template<typename Index, typename F>
+	void parallel_for(Index first, Index last, F f, size_t grain = 0)
+	{
+		if (!(first < last))
+			return;
+		detail::for_chunks(static_cast<size_t>(last - first), grain, [&](size_t b, size_t e) {
+			for (size_t i = b; i < e; ++i)
+				f(static_cast<Index>(first + i));
+		});
+	}
+
+	// Writes f(*it) to out for every element of [first, last); both ranges must be random access
+	template<typename InIt, typename OutIt, typename F>
+	OutIt parallel_transform(InIt first, InIt last, OutIt out, F f, size_t grain = 0)
+	{
+		size_t n = static_cast<size_t>(std::distance(first, last));
+		detail::for_chunks(n, grain, [&](size_t b, size_t e) {
+			std::transform(first + b, first + e, out + b, f);
+		});
+		return out + n;
+	}
+
+	// Combines every element of [first, last) with 'init' using 'op', which must be associative: each chunk is folded
+	// separately and the partial results are combined in range order, so 'op' need not be commutative
+	template<typename It, typename T, typename Op = std::plus<>>
+	T parallel_reduce(It first, It last, T init, Op op = Op(), size_t grain = 0)
+	{
+		size_t n = static_cast<size_t>(std::distance(first, last));
+		if (0 == n)
+			return init;
+		if (0 == grain)
+			grain = std::max<size_t>(1, n / (std::max<size_t>(1, detail::parallel_pool().size()) * 8));
+
+		size_t chunks = (n + grain - 1) / grain;
+		std::vector<std::unique_ptr<T>> partial(chunks);
+		detail::for_chunks(chunks, 1, [&](size_t c, size_t) {
+			It b = first + c * grain;
+			It e = first + std::min(n, (c + 1) * grain);
+			T acc = *b;
+			for (++b; b != e; ++b)
+				acc = op(std::move(acc), *b);
+			partial[c] = std::make_unique<T>(std::move(acc));
+		});
+
+		for (auto& p : partial)
+			init = op(std::move(init), std::move(*p));
+		return init;
+	}
+
+	// Sorts [first, last) (random access): chunks are sorted in parallel, then merged pairwise, one parallel round per level
+	template<typename It, typename Cmp = std::less<>>
+	void parallel_sort(It first, It last, Cmp cmp = Cmp())
+	{
+		size_t n = static_cast<size_t>(std::distance(first, last));
+		size_t chunks = std::min<size_t>(std::max<size_t>(1, detail::parallel_pool().size()), n / 2048 + 1);
+		auto bound = [&](size_t c) { return first + (n * c) / chunks; };
+
+		detail::for_chunks(chunks, 1, [&](size_t c, size_t) {
+			std::sort(bound(c), bound(c + 1), cmp);
+		});
+
+		for (size_t width = 1; width < chunks; width *= 2) {
+			size_t pairs = (chunks + 2 * width - 1) / (2 * width);
+			detail::for_chunks(pairs, 1, [&](size_t p, size_t) {
+				size_t lo = p * 2 * width;
+				size_t mid = std::min(chunks, lo + width);
+				size_t hi = std::min(chunks, lo + 2 * width);
+				if (mid < hi)
+					std::inplace_merge(bound(lo), bound(mid), bound(hi), cmp);
+			});
+		}
+	}
+}
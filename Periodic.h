@@ -0,0 +1,180 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+
+namespace Threading {
+
+	// What a periodic thread does with deadlines that already passed when it wakes up (callable slower than the period, preemption...)
+	enum class Overrun {
+		Skip,		// drop a deadline woken up for more than 'tolerance' late, wait for the next one on the grid
+		CatchUp,	// run once per missed deadline, back to back, until on time again
+		Coalesce	// run once for all the missed deadlines, then continue on the grid
+	};
+
+	struct PeriodicSchedule {
+		std::chrono::nanoseconds period;
+		Overrun overrun{ Overrun::Skip };
+		// Skip: lateness up to which a deadline still runs. It absorbs the wake-up latency of the OS, without which a
+		// short period could see every deadline dropped.
+		std::chrono::nanoseconds tolerance{ std::chrono::microseconds(500) };
+	};
+
+	// Lock-free histogram of durations, bucket i counts values in [2^i, 2^(i+1)) ns (bucket 0 also counts 0 and negative values)
+	class Histogram
+	{
+	public:
+		static constexpr size_t buckets = 40;
+
+	private:
+		std::atomic<uint64_t> counts[buckets]{};
+		std::atomic<uint64_t> n{ 0 };
+		std::atomic<uint64_t> sum_ns{ 0 };
+		std::atomic<uint64_t> max_ns{ 0 };
+
+	public:
+		void add(std::chrono::nanoseconds d) {
+			uint64_t v = (d.count() > 0) ? (uint64_t)d.count() : 0;
+			size_t b = 0;
+			while (b + 1 < buckets && (v >> (b + 1)) != 0)
+				++b;
+			counts[b].fetch_add(1, std::memory_order_relaxed);
+			n.fetch_add(1, std::memory_order_relaxed);
+			sum_ns.fetch_add(v, std::memory_order_relaxed);
+			uint64_t m = max_ns.load(std::memory_order_relaxed);
+			while (v > m && !max_ns.compare_exchange_weak(m, v, std::memory_order_relaxed)) {}
+		}
+
+		uint64_t count() const { return n.load(std::memory_order_relaxed); }
+		uint64_t bucket(size_t i) const { return counts[i].load(std::memory_order_relaxed); }
+		std::chrono::nanoseconds max() const { return std::chrono::nanoseconds(max_ns.load(std::memory_order_relaxed)); }
+		std::chrono::nanoseconds mean() const {
+			uint64_t c = count();
+			return std::chrono::nanoseconds(c ? sum_ns.load(std::memory_order_relaxed) / c : 0);
+		}
+		// upper bound of the bucket holding the 'q' quantile (q in [0, 1]), at most max()
+		std::chrono::nanoseconds quantile(double q) const {
+			uint64_t c = count();
+			uint64_t target = (uint64_t)(q * c);
+			uint64_t acc = 0;
+			for (size_t i = 0; i < buckets; ++i) {
+				acc += bucket(i);
+				if (acc > target || (acc == c && c > 0))
+					return std::min(std::chrono::nanoseconds((uint64_t)1 << (i + 1)), max());
+			}
+			return std::chrono::nanoseconds(0);
+		}
+	};
+
+	struct PeriodicStats {
+		Histogram lateness;		// wake-up time minus deadline
+		Histogram execution;	// time spent in the callable, per run
+		std::atomic<uint64_t> runs{ 0 };
+		std::atomic<uint64_t> skipped{ 0 };		// deadlines dropped by Overrun::Skip, without running
+		std::atomic<uint64_t> coalesced{ 0 };	// deadlines merged into another run by Overrun::Coalesce
+	};
+
+	// Schedule and statistics of a periodic SafeThread, shared by the thread object and the running thread
+	class PeriodicState
+	{
+		using clock = std::chrono::steady_clock;
+
+		// longest uninterrupted sleep: bounds how long stop() waits for a thread with a long period
+		static constexpr std::chrono::milliseconds max_sleep{ 50 };
+
+		PeriodicSchedule schedule;
+		std::atomic<bool> stop_requested{ false };
+		bool started{ false };
+		clock::time_point next;
+
+		// sleeps until 't' against an absolute deadline; returns false if stop was requested
+		bool sleep_until(clock::time_point t) {
+			while (true) {
+				if (stop_requested.load(std::memory_order_acquire))
+					return false;
+				auto now = clock::now();
+				if (now >= t)
+					return true;
+				auto wake = std::min(t, now + std::chrono::duration_cast<clock::duration>(max_sleep));
+#if defined(__linux__)
+				// steady_clock is CLOCK_MONOTONIC: sleep to the absolute time so that no drift accumulates
+				auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wake.time_since_epoch()).count();
+				timespec ts{ (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+#elif defined(_WIN32)
+				// Sleep() has the scheduler tick granularity, a high resolution waitable timer does not
+				struct Timer {
+					HANDLE h{ CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS) };
+					~Timer() { if (h) CloseHandle(h); }
+				};
+				static thread_local Timer timer;
+				LARGE_INTEGER due;
+				due.QuadPart = -std::max<long long>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(wake - now).count() / 100);
+				if (timer.h && SetWaitableTimer(timer.h, &due, 0, NULL, NULL, FALSE))
+					WaitForSingleObject(timer.h, INFINITE);
+				else
+					std::this_thread::sleep_until(wake);
+#else
+				std::this_thread::sleep_until(wake);
+#endif
+			}
+		}
+
+	public:
+		PeriodicStats stats;
+
+		PeriodicState(const PeriodicSchedule& s) : schedule(s) {
+			schedule.period = std::max(schedule.period, std::chrono::nanoseconds(1));
+		}
+
+		void stop() {
+			stop_requested.store(true, std::memory_order_release);
+		}
+
+		// Calls 'body' at every deadline until stop() is called. The schedule survives 'body' throwing, so the
+		// thread keeps its grid when the exception handler asks to reenter.
+		template<typename F>
+		void run(F&& body) {
+			auto period = std::chrono::duration_cast<clock::duration>(schedule.period);
+			if (!started) {
+				next = clock::now();
+				started = true;
+			}
+
+			while (sleep_until(next)) {
+				auto woke = clock::now();
+				stats.lateness.add(woke - next);
+				auto missed = (woke - next) / period;
+
+				if (Overrun::Skip == schedule.overrun) {
+					if (woke - next > schedule.tolerance) {
+						// too late for this deadline and the ones missed before it: sleep to the first one ahead
+						next += (missed + 1) * period;
+						stats.skipped.fetch_add(missed + 1, std::memory_order_relaxed);
+						continue;
+					}
+					// late within the tolerance, which may span several periods: run for the latest deadline
+					next += missed * period;
+					stats.skipped.fetch_add(missed, std::memory_order_relaxed);
+				}
+				if (missed > 0 && Overrun::Coalesce == schedule.overrun) {
+					next += missed * period;
+					stats.coalesced.fetch_add(missed, std::memory_order_relaxed);
+				}
+				next += period;
+
+				body();
+				stats.execution.add(clock::now() - woke);
+				stats.runs.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+	};
+}
@@ -0,0 +1,345 @@
+#pragma once
+#include "SafeThread.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <type_traits>
+
+
+namespace Threading {
+
+	// Counters of a pipeline stage. Each one has a single writer (the stage, or the thread feeding it), so updating
+	// them is a load and a store.
+	struct StageStats {
+		std::atomic<uint64_t> items{ 0 };			// taken from the input ring
+		std::atomic<uint64_t> batches{ 0 };		// rounds processed to the end, a round cut by a throw is not one
+		std::atomic<uint64_t> idle_waits{ 0 };		// times the stage slept on an empty input
+		std::atomic<uint64_t> full_waits{ 0 };		// times the feeding thread blocked on a full input (backpressure)
+		std::atomic<uint64_t> wakeups{ 0 };		// times the feeding thread had to wake the stage up
+		std::atomic<uint64_t> failures{ 0 };		// items whose processing threw
+		std::atomic<size_t> peak_occupancy{ 0 };
+	};
+
+	namespace detail {
+
+		inline void bump(std::atomic<uint64_t>& counter) {
+			counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+
+		// Bounded single producer single consumer ring. Each side keeps its index and a cached copy of the other side's
+		// index on its own cache line, so the sides only share a line when the cached copy runs out.
+		// Sleeping is announced with a flag checked after a fence by the other side, so that set() is only called when the
+		// other side actually sleeps. The waking side clears the flag: one sleep gets one set() however many flushes it
+		// takes the sleeper to run again.
+		template<typename T>
+		class SpscRing
+		{
+			static constexpr size_t cache_line = 64;
+
+			struct alignas(cache_line) Consumer {
+				std::atomic<size_t> head{ 0 };
+				size_t local_head{ 0 };		// taken but not yet released
+				size_t cached_tail{ 0 };
+				std::atomic<bool> sleeping{ false };
+			};
+			struct alignas(cache_line) Producer {
+				std::atomic<size_t> tail{ 0 };
+				size_t local_tail{ 0 };		// put but not yet flushed
+				size_t cached_head{ 0 };
+				std::atomic<bool> sleeping{ false };
+			};
+
+			Consumer c;
+			Producer p;
+			alignas(cache_line) std::atomic<bool> closed{ false };
+			const size_t mask;
+			std::unique_ptr<T[]> slots;
+			Event data_ev;
+			Event space_ev;
+
+		public:
+			StageStats stats;
+
+			SpscRing(size_t capacity) : mask(round_up(capacity) - 1), slots(new T[mask + 1]) {}
+
+			static size_t round_up(size_t n) {
+				size_t r = 1;
+				while (r < n)
+					r <<= 1;
+				return r;
+			}
+
+			size_t capacity() const {
+				return mask + 1;
+			}
+			size_t occupancy() const {
+				return p.tail.load(std::memory_order_relaxed) - c.head.load(std::memory_order_relaxed);
+			}
+
+			// Producer side
+
+			bool try_put(T&& v) {
+				if (p.local_tail - p.cached_head > mask) {
+					p.cached_head = c.head.load(std::memory_order_acquire);
+					if (p.local_tail - p.cached_head > mask)
+						return false;
+				}
+				slots[p.local_tail & mask] = std::move(v);
+				++p.local_tail;
+				return true;
+			}
+
+			// blocks while the ring is full
+			void put(T&& v) {
+				while (!try_put(std::move(v))) {
+					// the consumer cannot make room for what it does not see
+					flush();
+					bump(stats.full_waits);
+					p.sleeping.store(true, std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					if (p.local_tail - c.head.load(std::memory_order_acquire) > mask)
+						space_ev.wait();
+					p.sleeping.store(false, std::memory_order_relaxed);
+				}
+			}
+
+			// makes the items put so far visible, waking the consumer up only if it sleeps
+			void flush() {
+				if (p.local_tail == p.tail.load(std::memory_order_relaxed))
+					return;
+				p.tail.store(p.local_tail, std::memory_order_release);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (c.sleeping.load(std::memory_order_relaxed) && c.sleeping.exchange(false, std::memory_order_relaxed)) {
+					bump(stats.wakeups);
+					data_ev.set();
+				}
+			}
+
+			void close() {
+				flush();
+				closed.store(true, std::memory_order_release);
+				data_ev.set();
+			}
+
+			// Consumer side
+
+			size_t available() {
+				if (c.cached_tail == c.local_head)
+					c.cached_tail = p.tail.load(std::memory_order_acquire);
+				return c.cached_tail - c.local_head;
+			}
+
+			T take() {
+				return std::move(slots[c.local_head++ & mask]);
+			}
+
+			// gives the slots taken so far back to the producer
+			void release() {
+				c.head.store(c.local_head, std::memory_order_release);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (p.sleeping.load(std::memory_order_relaxed) && p.sleeping.exchange(false, std::memory_order_relaxed))
+					space_ev.set();
+			}
+
+			// sleeps until something is flushed or the ring is closed; returns false once closed and drained
+			bool wait_data() {
+				c.sleeping.store(true, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				bool is_closed = closed.load(std::memory_order_acquire);
+				if (0 == available() && !is_closed) {
+					bump(stats.idle_waits);
+					data_ev.wait();
+				}
+				c.sleeping.store(false, std::memory_order_relaxed);
+				return !(is_closed && 0 == available());
+			}
+		};
+
+		struct StageBase {
+			virtual ~StageBase() {}
+		};
+
+		// Thread taking the items of 'in' by batches, passing f(item) to 'out' (none for a sink, Out = void)
+		template<typename In, typename Out, typename F>
+		class Stage : public StageBase
+		{
+			std::shared_ptr<SpscRing<In>> in;
+			std::shared_ptr<SpscRing<Out>> out;
+			F f;
+			size_t batch;
+			std::unique_ptr<SafeThread> thread;
+
+			void run() {
+				while (true) {
+					size_t n = in->available();
+					if (0 == n) {
+						// do not sit on unflushed output while idle
+						if constexpr (!std::is_void<Out>::value)
+							out->flush();
+						in->release();
+						if (in->wait_data())
+							continue;
+						if constexpr (!std::is_void<Out>::value)
+							out->close();
+						return;
+					}
+
+					if (n > in->stats.peak_occupancy.load(std::memory_order_relaxed))
+						in->stats.peak_occupancy.store(n, std::memory_order_relaxed);
+					n = std::min(n, batch);
+					for (size_t i = 0; i < n; ++i) {
+						// taken before processing: an item that throws is skipped when the thread reenters, and counted once
+						In item = in->take();
+						bump(in->stats.items);
+						if constexpr (std::is_void<Out>::value)
+							f(std::move(item));
+						else
+							out->put(f(std::move(item)));
+					}
+					in->release();
+					bump(in->stats.batches);
+					if constexpr (!std::is_void<Out>::value)
+						out->flush();
+				}
+			}
+
+		public:
+			Stage(const std::wstring& name, std::shared_ptr<SpscRing<In>> _in, std::shared_ptr<SpscRing<Out>> _out, F&& _f, size_t _batch,
+				std::function<bool(SafeThread&, tracked_exception&)> user_handler)
+				: in(std::move(_in)), out(std::move(_out)), f(std::move(_f)), batch(std::max<size_t>(_batch, 1))
+			{
+				SafeThread::ExceptionHandler exh([this, user_handler](SafeThread& t, tracked_exception& ex) {
+					bump(in->stats.failures);
+					if (user_handler)
+						user_handler(t, ex);
+					// go on with the next item
+					return true;
+				});
+				thread = std::make_unique<SafeThread>(name, std::move(exh), [this]() { run(); });
+			}
+
+			~Stage() {
+				thread.reset();
+			}
+		};
+	}
+
+	template<typename In, typename Cur = In> class PipelineBuilder;
+
+	// Chain of SafeThread stages connected by bounded SPSC rings, fed with push(). Destruction closes the input, lets
+	// every stage drain, then joins them.
+	template<typename In>
+	class Pipeline
+	{
+		template<typename, typename> friend class PipelineBuilder;
+
+		std::shared_ptr<detail::SpscRing<In>> input;
+		std::vector<std::shared_ptr<void>> rings;		// input ring of each stage, 'input' first
+		std::vector<const StageStats*> stage_stats;
+		std::vector<size_t> capacities;
+		std::vector<std::unique_ptr<detail::StageBase>> stages;
+		std::vector<std::function<size_t()>> occupancies;
+		bool closed{ false };
+
+		Pipeline() {}
+
+	public:
+		Pipeline(Pipeline&&) = default;
+
+		~Pipeline() {
+			close();
+			// in stage order: each stage closes the next one's input once drained
+			for (auto& s : stages)
+				s.reset();
+		}
+
+		// Blocks while the first stage's ring is full. push() and try_push() must be called from one thread at a time.
+		void push(In v) {
+			input->put(std::move(v));
+			input->flush();
+		}
+		bool try_push(In v) {
+			if (!input->try_put(std::move(v)))
+				return false;
+			input->flush();
+			return true;
+		}
+
+		// no more input: the stages finish what is queued, then exit
+		void close() {
+			if (input && !closed) {
+				closed = true;
+				input->close();
+			}
+		}
+
+		size_t stage_count() const {
+			return stages.size();
+		}
+		const StageStats& stats(size_t stage) const {
+			return *stage_stats[stage];
+		}
+		// items queued in front of 'stage' out of capacity(stage)
+		size_t occupancy(size_t stage) const {
+			return occupancies[stage]();
+		}
+		size_t capacity(size_t stage) const {
+			return capacities[stage];
+		}
+	};
+
+	// Builds a Pipeline from its first stage to its sink:
+	//	auto p = PipelineBuilder<Raw>(1024, 64).stage(L"parse", parse).stage(L"enrich", enrich).sink(L"store", store);
+	// Each stage is a SafeThread named after it, taking up to 'batch' items per round from a ring of 'capacity' items.
+	// An item whose processing throws goes to the exception handler and is dropped.
+	template<typename In, typename Cur>
+	class PipelineBuilder
+	{
+		template<typename, typename> friend class PipelineBuilder;
+
+		size_t capacity;
+		size_t batch;
+		std::function<bool(SafeThread&, tracked_exception&)> handler;
+		Pipeline<In> pipe;
+		std::shared_ptr<detail::SpscRing<Cur>> tail;
+
+		template<typename C>
+		void add_ring(const std::shared_ptr<detail::SpscRing<C>>& ring) {
+			pipe.rings.push_back(ring);
+			pipe.stage_stats.push_back(&ring->stats);
+			pipe.capacities.push_back(ring->capacity());
+			pipe.occupancies.push_back([ring]() { return ring->occupancy(); });
+		}
+
+		PipelineBuilder(size_t _capacity, size_t _batch, std::function<bool(SafeThread&, tracked_exception&)> _handler,
+			Pipeline<In>&& _pipe, std::shared_ptr<detail::SpscRing<Cur>> _tail)
+			: capacity(_capacity), batch(_batch), handler(std::move(_handler)), pipe(std::move(_pipe)), tail(std::move(_tail)) {}
+
+	public:
+		PipelineBuilder(size_t _capacity = 1024, size_t _batch = 64,
+			const SafeThread::ExceptionHandler& exh = SafeThread::ExceptionHandler(SafeThread::defaultExHandler))
+			: capacity(_capacity), batch(_batch), handler(exh.get())
+		{
+			pipe.input = std::make_shared<detail::SpscRing<In>>(capacity);
+			tail = pipe.input;
+			add_ring(tail);
+		}
+
+		template<typename F>
+		auto stage(const std::wstring& name, F f) && {
+			using Out = typename std::decay<typename std::invoke_result<F, Cur&&>::type>::type;
+			auto out = std::make_shared<detail::SpscRing<Out>>(capacity);
+			pipe.stages.push_back(std::make_unique<detail::Stage<Cur, Out, F>>(name, tail, out, std::move(f), batch, handler));
+			add_ring(out);
+			return PipelineBuilder<In, Out>(capacity, batch, std::move(handler), std::move(pipe), std::move(out));
+		}
+
+		template<typename F>
+		Pipeline<In> sink(const std::wstring& name, F f) && {
+			pipe.stages.push_back(std::make_unique<detail::Stage<Cur, void, F>>(name, tail, nullptr, std::move(f), batch, handler));
+			return std::move(pipe);
+		}
+	};
+}
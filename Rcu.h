@@ -0,0 +1,275 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <list>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+
+namespace Rcu {
+
+	// Epoch based reclamation shared by every rcu_ref. Each reading thread owns a slot where it publishes the epoch it
+	// entered its read section at (0 when outside); an object retired at epoch e is freed once no slot holds e or less.
+	// SafeThreads take their slot when they start and give it back when they exit; other threads, and fibers, take one
+	// on first read.
+	class Domain
+	{
+		struct alignas(64) ReaderSlot {
+			std::atomic<uint64_t> epoch{ 0 };
+			bool in_use{ false };
+		};
+
+		struct Retired {
+			uint64_t epoch;
+			void* p;
+			void (*destroy)(void*);
+		};
+
+		struct ThreadReader {
+			ReaderSlot* slot{ nullptr };
+			unsigned nesting{ 0 };
+			~ThreadReader() {
+				if (slot)
+					inst().release(*this);
+			}
+		};
+	public:
+		// Read state of a fiber, switched in by its carrier: a fiber reads through a slot of its own, so that its open
+		// sections, and abandon_reads() after a fault in it, are not those of the other fibers of the carrier
+		class FiberReader {
+			friend class Domain;
+			ThreadReader r;
+		};
+
+	private:
+		static FiberReader*& fiber_reader() {
+			static thread_local FiberReader* f{ nullptr };
+			return f;
+		}
+		static ThreadReader& reader() {
+			if (FiberReader* f = fiber_reader())
+				return f->r;
+			static thread_local ThreadReader r;
+			return r;
+		}
+
+		std::atomic<uint64_t> global_epoch{ 1 };
+		std::mutex mtx;
+		std::list<ReaderSlot> slots;	// never shrinks, released slots are reused
+		std::vector<Retired> retired;
+
+		ThreadReader& this_reader() {
+			ThreadReader& reader = Domain::reader();
+			if (nullptr == reader.slot) {
+				std::unique_lock<std::mutex> lock(mtx);
+				for (auto& s : slots) {
+					if (!s.in_use) {
+						reader.slot = &s;
+						break;
+					}
+				}
+				if (nullptr == reader.slot)
+					reader.slot = &slots.emplace_back();
+				reader.slot->in_use = true;
+			}
+			return reader;
+		}
+
+		void release(ThreadReader& r) {
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				r.slot->epoch.store(0, std::memory_order_release);
+				r.slot->in_use = false;
+				r.slot = nullptr;
+				r.nesting = 0;
+			}
+			reclaim();
+		}
+
+		// oldest epoch still read, call with mtx held
+		uint64_t oldest_reader() {
+			uint64_t oldest = std::numeric_limits<uint64_t>::max();
+			for (auto& s : slots) {
+				uint64_t e = s.epoch.load(std::memory_order_seq_cst);
+				if (e != 0 && e < oldest)
+					oldest = e;
+			}
+			return oldest;
+		}
+
+	public:
+		static Domain& inst() {
+			static Domain d;
+			return d;
+		}
+
+		~Domain() {
+			for (auto& r : retired)
+				r.destroy(r.p);
+		}
+
+		// Read side: plain stores and a fence, no read-modify-write. Sections nest.
+		static void read_lock() {
+			Domain& d = inst();
+			ThreadReader& r = d.this_reader();
+			if (r.nesting++ == 0) {
+				r.slot->epoch.store(d.global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+				// the epoch must be visible before the pointer is read, or a writer could free what we are about to read
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			}
+		}
+		static void read_unlock() {
+			ThreadReader& r = reader();
+			if (--r.nesting == 0)
+				r.slot->epoch.store(0, std::memory_order_release);
+		}
+
+		// Leaves every read section of the calling thread, or fiber; for the SafeThread and fiber wrappers, after a fault
+		// skipped their guards
+		static void abandon_reads() {
+			ThreadReader& r = reader();
+			if (r.slot && r.nesting != 0) {
+				r.nesting = 0;
+				r.slot->epoch.store(0, std::memory_order_release);
+			}
+		}
+
+		// Makes the calling thread read as 'f', nullptr for itself; returns the previous one
+		static FiberReader* switch_reader(FiberReader* f) {
+			FiberReader* previous = fiber_reader();
+			fiber_reader() = f;
+			return previous;
+		}
+
+		static void register_thread() {
+			inst().this_reader();
+		}
+		static void unregister_thread() {
+			ThreadReader& r = reader();
+			if (r.slot)
+				inst().release(r);
+		}
+
+		// Frees 'p' with 'destroy' once the readers that may still see it are gone. 'p' must be unreachable for new readers.
+		void retire(void* p, void (*destroy)(void*)) {
+			uint64_t e = global_epoch.fetch_add(1, std::memory_order_seq_cst);
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				retired.push_back({ e, p, destroy });
+			}
+			reclaim();
+		}
+
+		// Frees every retired object no reader can see anymore
+		void reclaim() {
+			std::vector<Retired> ready;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				uint64_t oldest = oldest_reader();
+				auto it = std::partition(retired.begin(), retired.end(), [oldest](const Retired& r) { return r.epoch >= oldest; });
+				ready.assign(std::make_move_iterator(it), std::make_move_iterator(retired.end()));
+				retired.erase(it, retired.end());
+			}
+			// destructors run outside of the lock, they may publish or retire in turn
+			for (auto& r : ready)
+				r.destroy(r.p);
+		}
+
+		// Waits until the read sections open at the time of the call are over, then reclaims.
+		// Must not be called from inside a read section.
+		void synchronize() {
+			uint64_t e = global_epoch.fetch_add(1, std::memory_order_seq_cst);
+			while (true) {
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					if (oldest_reader() > e)
+						break;
+				}
+				std::this_thread::yield();
+			}
+			reclaim();
+		}
+
+		size_t pending() {
+			std::unique_lock<std::mutex> lock(mtx);
+			return retired.size();
+		}
+	};
+}
+
+
+// Read-mostly publication of a T. Readers take a snapshot, which stays valid and unchanged for as long as they hold
+// it, without locks or atomic read-modify-write. Writers publish a new version; the previous one is freed once the
+// snapshots that may point to it are released.
+// Unlike atomic_ref, rcu_ref owns the published objects.
+template<typename T>
+class rcu_ref {
+
+	std::atomic<T*> current;
+	std::mutex write_mtx;
+
+	static void destroy(void* p) {
+		delete static_cast<T*>(p);
+	}
+
+public:
+
+	class snapshot {
+		const T* p{ nullptr };
+		bool held{ false };
+		friend class rcu_ref;
+		explicit snapshot(const rcu_ref& r) : held(true) {
+			Rcu::Domain::read_lock();
+			p = r.current.load(std::memory_order_acquire);
+		}
+	public:
+		snapshot(snapshot&& x) noexcept : p(x.p), held(x.held) { x.held = false; }
+		snapshot(const snapshot&) = delete;
+		snapshot& operator=(const snapshot&) = delete;
+		snapshot& operator=(snapshot&&) = delete;
+		~snapshot() {
+			if (held)
+				Rcu::Domain::read_unlock();
+		}
+
+		const T& operator*() const noexcept { return *p; }
+		const T* operator->() const noexcept { return p; }
+		const T& get() const noexcept { return *p; }
+	};
+
+	rcu_ref(std::unique_ptr<T> initial) : current(initial.release()) {}
+	template<typename... Args>
+	rcu_ref(std::in_place_t, Args&&... args) : current(new T(std::forward<Args>(args)...)) {}
+
+	// no snapshot may outlive the rcu_ref
+	~rcu_ref() {
+		delete current.load(std::memory_order_relaxed);
+	}
+
+	rcu_ref(const rcu_ref&) = delete;
+	rcu_ref& operator=(const rcu_ref&) = delete;
+
+	snapshot read() const {
+		return snapshot(*this);
+	}
+
+	void publish(std::unique_ptr<T> next) {
+		T* old = current.exchange(next.release(), std::memory_order_seq_cst);
+		Rcu::Domain::inst().retire(old, &destroy);
+	}
+
+	// Copy, modify, publish; concurrent updates are serialized so that none is lost
+	template<typename F>
+	void update(F&& modify) {
+		std::unique_lock<std::mutex> lock(write_mtx);
+		auto next = std::make_unique<T>(*current.load(std::memory_order_acquire));
+		modify(*next);
+		publish(std::move(next));
+	}
+};
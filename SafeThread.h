@@ -1,11 +1,27 @@
 #pragma once
+#if defined(_WIN32)
 #define NOMINMAX
 #include <windows.h>
+#include "StackWalker.h"
+#else
+#include <csignal>
+#include <csetjmp>
+#include <cstring>
+#include <cstdlib>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <execinfo.h>
+#include <unistd.h>
+#endif
 #include "Event.h"
 #include "TypeTraits.h"
 #include "logger.h"
 #include "NamedType.h"
-#include "StackWalker.h"
+#include "Trace.h"
+#include "Periodic.h"
+#include "Rcu.h"
+#include "Metrics.h"
+#include "ThreadCache.h"
 #include <thread>
 #include <type_traits>
 #include <string>
@@ -13,6 +29,8 @@
 #include <mutex>
 #include <unordered_set>
 #include <atomic>
+#include <exception>
+#include <functional>
 
 
 
@@ -56,42 +74,81 @@ public:
 
 
 
+#if defined(_WIN32)
+using ExceptionInfo = EXCEPTION_POINTERS;
+#else
+// What the fault signal handler received, copied out of the signal frame before jumping back to the SafeThread wrapper.
+// The general purpose registers of 'context' are valid, its floating point state pointer is not.
+struct ExceptionInfo {
+	siginfo_t info;
+	ucontext_t context;
+	void* frames[64];	// call stack at the fault
+	int n_frames;
+};
+#endif
+
 class tracked_exception : public std::exception {
 protected:
-	EXCEPTION_POINTERS* pExp{ nullptr };
-	tracked_exception(EXCEPTION_POINTERS* pe = nullptr) : pExp(pe) {}
+	ExceptionInfo* pExp{ nullptr };
+	tracked_exception(ExceptionInfo* pe = nullptr) : pExp(pe) {}
 	tracked_exception(const tracked_exception& rhs) : pExp(rhs.pExp) {}
 public:
-	EXCEPTION_POINTERS* getExceptionPointers() { return pExp; }
+	// only valid while the exception handler runs; nullptr for C++ exceptions on POSIX
+	ExceptionInfo* getExceptionPointers() { return pExp; }
+	// the exception as it should reach code outside the handler (futures, parallel algorithms...)
+	virtual std::exception_ptr to_exception_ptr() const = 0;
 };
 
+// C++ exception thrown by the thread function, carried without slicing
 class ccW_exception : public tracked_exception {
-	std::exception original_cc_exc;
+	std::exception_ptr original;
+	mutable std::string s_what{ "" };
 
 public:
-	ccW_exception(std::exception&& original, EXCEPTION_POINTERS* pe = nullptr) : tracked_exception(pe), original_cc_exc(std::move(original)) {}
-	ccW_exception(const ccW_exception& rhs) : tracked_exception(rhs), original_cc_exc(std::move(rhs.original_cc_exc)) {}
+	ccW_exception(std::exception_ptr _original, ExceptionInfo* pe = nullptr) : tracked_exception(pe), original(std::move(_original)) {}
+	ccW_exception(const ccW_exception& rhs) : tracked_exception(rhs), original(rhs.original) {}
 
-	const char* what() const override {
-		return original_cc_exc.what();
+	std::exception_ptr getOriginal() const { return original; }
+	std::exception_ptr to_exception_ptr() const override { return original; }
+
+	const char* what() const noexcept override {
+		if (s_what.empty()) {
+			try {
+				std::rethrow_exception(original);
+			}
+			catch (std::exception& ex) {
+				s_what = ex.what();
+			}
+			catch (...) {
+				s_what = "unknown C++ exception";
+			}
+		}
+		return s_what.c_str();
 	}
 };
 
+// Structured exception on Windows, fault signal (SIGSEGV, SIGBUS, SIGFPE, SIGILL) on POSIX
 class SE_exception : public tracked_exception {
 private:
 	SE_exception() {}
 	unsigned int nSE;
 	mutable std::string s_what{ "" };
 public:
-	SE_exception(unsigned int n, EXCEPTION_POINTERS* pe = nullptr) : tracked_exception(pe), nSE(n) {}
+	SE_exception(unsigned int n, ExceptionInfo* pe = nullptr) : tracked_exception(pe), nSE(n) {}
 	SE_exception(const SE_exception& rhs) : tracked_exception(rhs), nSE(rhs.nSE) {}
 	~SE_exception() {}
 	unsigned int getSeNumber() { return nSE; }
-	const char* what() const override {
+	// the exception records point into the handler's frame: the copy escaping it goes without them
+	std::exception_ptr to_exception_ptr() const override { return std::make_exception_ptr(SE_exception(nSE)); }
+	const char* what() const noexcept override {
 		if (s_what.empty()) {
 			std::stringstream ss;
+#if defined(_WIN32)
 			ss.flags(std::ios::hex);
 			ss << "Structured exception, code: " << nSE;
+#else
+			ss << "Signal " << nSE << " (" << strsignal(nSE) << ")";
+#endif
 			s_what = ss.str();
 		}
 		return s_what.c_str();
@@ -102,8 +159,13 @@ public:
 
 namespace Threading {
 
+	class Fiber;
+
 	class SafeThread
 	{
+		// runs its fibers in try_catch_wrapper
+		friend class Fiber;
+
 	protected:
 
 		class SharedInst {
@@ -148,17 +210,28 @@ namespace Threading {
 
 		using ExceptionHandler = NamedType<ExHnd, struct ExceptionHandlerTag>;
 		using Frozen = NamedType<bool, struct FrozenTag>;
+		// runs the callable at a fixed rate instead of once, until stop_periodic() or destruction
+		using Periodic = NamedType<PeriodicSchedule, struct PeriodicTag>;
 
 
 	private:
 
 		static std::wstring s2ws(const std::string& s) {
+#if defined(_WIN32)
 			int len;
 			int slength = (int)s.length();
 			len = MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, 0, 0);
 			std::wstring r(len, L'\0');
 			MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, &r[0], len);
 			return r;
+#else
+			std::wstring r(s.length(), L'\0');
+			size_t len = mbstowcs(&r[0], s.c_str(), s.length());
+			if (len == (size_t)-1)
+				return std::wstring(s.begin(), s.end());
+			r.resize(len);
+			return r;
+#endif
 		}
 		static const std::wstring& s2ws(const std::wstring& s) {
 			return s;
@@ -170,9 +243,10 @@ namespace Threading {
 		ExHnd exception_handler{ defaultExHandler };
 		std::mutex name_mtx;
 		std::mutex ex_mtx;
-		std::thread thread;
+		ThreadHandle thread;
 		std::atomic<SingleEvent*> unfreeze_event{ nullptr };
 		std::unique_ptr<atomic_ref<SafeThread>> owner;
+		std::shared_ptr<PeriodicState> periodic;
 		static const inline std::unique_ptr<SharedInst> shared{ std::make_unique<SharedInst>() };
 
 
@@ -183,6 +257,7 @@ namespace Threading {
 			setName(std::move(t.name));
 			setExceptionHandler(ExceptionHandler(t.exception_handler));
 			owner = std::move(t.owner);
+			periodic = std::move(t.periodic);
 			*owner = *this;
 			auto ev = t.unfreeze_event.load(std::memory_order_acquire);
 			unfreeze_event.store(ev, std::memory_order_release);
@@ -195,15 +270,32 @@ namespace Threading {
 		{
 			std::wstringstream wss;
 			wss.flags(std::ios::hex);
+#if defined(_WIN32)
 			wss << L"Thread \"" << t.name << "\" -> (hnd: " << t.native_handle() << ", id: " <<
 				GetThreadId(t.native_handle()) << ") encountered exception " << s2ws(ex.what()) << std::endl;
 
-			Stackwalk::StackWalker::passPrettyTrace([&](const std::string& trce) {
-				wss << L"Stack trace: " << std::endl << s2ws(trce) << std::endl;
-			}, ex.getExceptionPointers()->ContextRecord);
+			// no exception record for exceptions reported outside of a handler
+			if (EXCEPTION_POINTERS* pExp = ex.getExceptionPointers()) {
+				Stackwalk::StackWalker::passPrettyTrace([&](const std::string& trce) {
+					wss << L"Stack trace: " << std::endl << s2ws(trce) << std::endl;
+				}, pExp->ContextRecord);
+			}
 
 			OutputDebugStringW(wss.str().c_str());
 			fwprintf(stderr, wss.str().c_str());
+#else
+			wss << L"Thread \"" << t.name << "\" -> (hnd: " << t.native_handle() << ") encountered exception " << s2ws(ex.what()) << std::endl;
+
+			if (ExceptionInfo* info = ex.getExceptionPointers()) {
+				wss << L"Fault address: " << info->info.si_addr << std::endl << L"Stack trace: " << std::endl;
+				char** symbols = backtrace_symbols(info->frames, info->n_frames);
+				for (int i = 0; symbols && i < info->n_frames; ++i)
+					wss << s2ws(symbols[i]) << std::endl;
+				free(symbols);
+			}
+
+			fwprintf(stderr, L"%ls", wss.str().c_str());
+#endif
 			Logger::defprintf(wss.str());
 
 			return false;
@@ -211,16 +303,27 @@ namespace Threading {
 
 	private:
 
-		template<typename Func, typename Handler>
-		static void try_catch_wrapper(Func& f, Handler& h)
+#if defined(_WIN32)
+		template<typename Func>
+		static void run_keeping_exception(Func& f, std::exception_ptr* original)
 		{
+			try {
+				f();
+			}
+			catch (...) {
+				*original = std::current_exception();
+				throw;
+			}
+		}
 
-			std::exception* original = new std::exception;
-
+		// no object with a destructor may live in the frame of __try (C2712): 'original' belongs to the caller
+		template<typename Func, typename Handler>
+		static void seh_frame(Func& f, Handler& h, std::exception_ptr* original)
+		{
 			auto handle_seh = [&](unsigned int code, EXCEPTION_POINTERS* pExp) {
 
 				if (code == 0xE06D7363) {
-					ccW_exception ex(std::move(*original), pExp);
+					ccW_exception ex(*original, pExp);
 					h(ex);
 				}
 				else {
@@ -231,63 +334,201 @@ namespace Threading {
 			};
 
 			__try {
-				[&]() {
-					try {
-						f();
+				run_keeping_exception(f, original);
+			}
+			__except (handle_seh(GetExceptionCode(), GetExceptionInformation())) {}
+		}
+
+		template<typename Func, typename Handler>
+		static void try_catch_wrapper(Func&& f, Handler&& h)
+		{
+			// stays empty, and allocation free, unless f throws
+			std::exception_ptr original;
+			seh_frame(f, h, &original);
+		};
+#else
+		// Innermost try_catch_wrapper running on this thread: where the fault signal handler jumps back to
+		struct FaultScope {
+			sigjmp_buf env;
+			ExceptionInfo fault;
+			FaultScope* previous{ nullptr };
+
+			static inline thread_local FaultScope* current{ nullptr };
+
+			FaultScope() : previous(current) { current = this; }
+			~FaultScope() { current = previous; }
+		};
+
+		static constexpr int fault_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL };
+		static inline struct sigaction previous_actions[NSIG];
+
+		static void fault_handler(int sig, siginfo_t* si, void* uctx)
+		{
+			FaultScope* scope = FaultScope::current;
+			if (nullptr == scope) {
+				// not on a SafeThread: hand the fault to whoever handled it before us, or to the default action
+				const struct sigaction& prev = previous_actions[sig];
+				if ((prev.sa_flags & SA_SIGINFO) && prev.sa_sigaction)
+					return prev.sa_sigaction(sig, si, uctx);
+				if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN)
+					return prev.sa_handler(sig);
+				signal(sig, SIG_DFL);
+				return;	// the faulting instruction runs again and takes the default action
+			}
+
+			// no allocation in here: everything is copied to the scope, on the faulting thread's stack
+			memcpy(&scope->fault.info, si, sizeof(siginfo_t));
+			memcpy(&scope->fault.context, uctx, sizeof(ucontext_t));
+			scope->fault.n_frames = backtrace(scope->fault.frames, sizeof(scope->fault.frames) / sizeof(void*));
+			siglongjmp(scope->env, 1);
+		}
+
+		static void install_fault_handlers()
+		{
+			static std::once_flag once;
+			std::call_once(once, []() {
+				// backtrace() loads its unwinder on first use, which must not happen inside the signal handler
+				void* warm_up[1];
+				backtrace(warm_up, 1);
+
+				struct sigaction sa {};
+				sa.sa_sigaction = fault_handler;
+				sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+				sigemptyset(&sa.sa_mask);
+				for (int sig : fault_signals)
+					sigaction(sig, &sa, &previous_actions[sig]);
+			});
+		}
+
+		// Per thread alternate signal stack, so that a stack overflow can still be reported; mapped once per OS thread
+		static void ensure_alt_stack()
+		{
+			struct AltStack {
+				void* mem{ nullptr };
+				size_t size{ 0 };
+				AltStack() {
+					size = std::max<size_t>(64 * 1024, (size_t)SIGSTKSZ);
+					mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+					if (MAP_FAILED == mem) {
+						mem = nullptr;
+						return;
 					}
-					catch (std::exception& ex) {
-						*original = ex;
-						throw;
+					stack_t ss {};
+					ss.ss_sp = mem;
+					ss.ss_size = size;
+					sigaltstack(&ss, nullptr);
+				}
+				~AltStack() {
+					if (mem) {
+						stack_t ss {};
+						ss.ss_flags = SS_DISABLE;
+						sigaltstack(&ss, nullptr);
+						munmap(mem, size);
 					}
-				}();
+				}
+			};
+			static thread_local AltStack alt_stack;
+			(void)alt_stack;
+		}
+
+		template<typename Func, typename Handler>
+		static void try_catch_wrapper(Func&& f, Handler&& h)
+		{
+			install_fault_handlers();
+			ensure_alt_stack();
+
+			FaultScope scope;
+			// the signal mask is not saved, which would cost a syscall per call: it is restored on the fault path only
+			if (0 != sigsetjmp(scope.env, 0)) {
+				// back from the fault handler: the frames between here and the fault are abandoned without unwinding
+				FaultScope::current = scope.previous;
+				// the mask the fault interrupted, without the fault signal the kernel blocked for the handler
+				pthread_sigmask(SIG_SETMASK, &scope.fault.context.uc_sigmask, nullptr);
+				SE_exception ex(scope.fault.info.si_signo, &scope.fault);
+				h(ex);
+				return;
 			}
-			__except (handle_seh(GetExceptionCode(), GetExceptionInformation())) {}
 
-			delete original;
+			try {
+				f();
+			}
+			catch (...) {
+				FaultScope::current = scope.previous;
+				ccW_exception ex(std::current_exception());
+				h(ex);
+			}
 		};
+#endif
 
 
 		template<typename F, typename... Args,
-			typename = std::enable_if<_is_invocable<F, Args...>::value>::type>
+			typename = typename std::enable_if<_is_invocable<F, Args...>::value>::type>
 		void WrapAndLaunch(F&& f, Args&&... args)
 		{
 			owner = std::make_unique<atomic_ref<SafeThread>>(*this);
 
 			SingleEvent* p_unfreeze_ev = unfreeze_event.load(std::memory_order_relaxed);
 
-			auto wrapped = [owner = this->owner.get(), p_unfreeze_ev](auto&& func, auto&&... arguments) mutable {
+			auto wrapped = [owner = this->owner.get(), p_unfreeze_ev, periodic = this->periodic](auto&& func, auto&&... arguments) mutable {
 
 				if (p_unfreeze_ev) {
 					p_unfreeze_ev->wait();
 					delete p_unfreeze_ev;
 				}
 
+				if (Tracing::Recorder::is_enabled() || Deadlock::WaitGraph::is_enabled()) {
+					std::unique_lock<std::mutex> lock(owner->get().name_mtx);
+					Tracing::Recorder::set_thread_name(owner->get().name);
+					Deadlock::WaitGraph::set_thread_name(std::this_thread::get_id(), owner->get().name);
+				}
+				Tracing::Recorder::record(Tracing::Point::FirstRun, owner);
+				Rcu::Domain::register_thread();
+				Metrics::Registry::on_thread_start();
+
 				bool reenter = false;
 
 				do
 				{
+					reenter = false;
 					try_catch_wrapper(
 						[&]() {
-							std::invoke(func, std::forward<decltype(arguments)>(arguments)...);
+							if (periodic)
+								periodic->run([&]() { std::invoke(func, arguments...); });
+							else
+								std::invoke(func, std::forward<decltype(arguments)>(arguments)...);
 						},
 						[&](tracked_exception& ex) {
+							Tracing::Recorder::record(Tracing::Point::Exception, owner);
+							// a fault skips the destructors of the snapshots held by the abandoned frames
+							Rcu::Domain::abandon_reads();
+							Metrics::Registry::on_exception();
 							// get a temporary copy of the function and call it
 							// to avoid a deadlock due to holding the lock while calling an external function
 							std::unique_lock<std::mutex> lock(owner->get().ex_mtx);
 							auto temp = owner->get().exception_handler;
 							lock.unlock();
 							reenter = temp(owner->get(), ex);
+							if (reenter) {
+								Tracing::Recorder::record(Tracing::Point::Reenter, owner);
+								Metrics::Registry::on_restart();
+							}
 						});
 
 				} while (reenter);
 
+				Tracing::Recorder::record(Tracing::Point::Exit, owner);
+				Deadlock::WaitGraph::forget_thread(std::this_thread::get_id());
+				Rcu::Domain::unregister_thread();
+				Metrics::Registry::on_thread_exit();
+
 			};
-			thread = std::thread(std::move(wrapped), std::forward<F>(f), std::forward<Args>(args)...);
+			Tracing::Recorder::record(Tracing::Point::Launch, owner.get());
+			thread.launch(std::move(wrapped), std::forward<F>(f), std::forward<Args>(args)...);
 			shared->add_thread(this);
 		}
 
 		template<typename Str,
-			typename = std::enable_if<is_string<Str>::type::value, is_string<Str>>::type,
+			typename = typename std::enable_if<is_string<Str>::type::value, is_string<Str>>::type,
 			typename... Args>
 		void WrapAndLaunch(Str&& _name, Args&&... args)
 		{
@@ -309,6 +550,13 @@ namespace Threading {
 			WrapAndLaunch(std::forward<Args>(args)...);
 		}
 
+		template<typename... Args>
+		void WrapAndLaunch(const Periodic& schedule, Args&&... args)
+		{
+			periodic = std::make_shared<PeriodicState>(schedule.get());
+			WrapAndLaunch(std::forward<Args>(args)...);
+		}
+
 		template<typename... Args>
 		void WrapAndLaunch(Frozen launch_frozen, Args&&... args)
 		{
@@ -341,6 +589,7 @@ namespace Threading {
 		}
 
 		~SafeThread() {
+			stop_periodic();
 			if (thread.joinable())
 				thread.join();
 			shared->remove_thread(this);
@@ -349,10 +598,12 @@ namespace Threading {
 
 
 		template<typename Str,
-			typename = std::enable_if<is_string<Str>::type::value>::type>
+			typename = typename std::enable_if<is_string<Str>::type::value>::type>
 		void setName(Str&& _name) {
 			std::unique_lock<std::mutex> lock(name_mtx);
 			name = s2ws(std::forward<Str>(_name));
+			if (thread.joinable())
+				Deadlock::WaitGraph::set_thread_name(thread.get_id(), name);
 		}
 
 		void setExceptionHandler(const ExceptionHandler& exh) {
@@ -368,12 +619,29 @@ namespace Threading {
 			SingleEvent* ev;
 			if ((ev = unfreeze_event.load(std::memory_order_acquire)) != nullptr) {
 				// the frozen thread is responsible for deleting the event object
+				Tracing::Recorder::record(Tracing::Point::Unfreeze, owner.get());
 				ev->set();
 				unfreeze_event.store(nullptr, std::memory_order_release);
 			}
 		}
 
-		void* native_handle() {
+		// Stops a periodic thread after its current run; it can then be joined
+		void stop_periodic() {
+			if (periodic)
+				periodic->stop();
+		}
+
+		// Lateness and execution time histograms of a periodic thread, nullptr otherwise
+		std::shared_ptr<const PeriodicStats> periodic_stats() const {
+			if (!periodic)
+				return nullptr;
+			return std::shared_ptr<const PeriodicStats>(periodic, &periodic->stats);
+		}
+
+		std::thread::id get_id() {
+			return thread.get_id();
+		}
+		std::thread::native_handle_type native_handle() {
 			return thread.native_handle();
 		}
 		bool joinable() {
@@ -0,0 +1,267 @@
+#pragma once
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#include <limits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+
+// Event living in a named POSIX shared memory segment, so that every process opening the same name sees the same event.
+// The whole state is a futex word that is only ever changed atomically: no lock is held across a wait, so a process
+// dying at any point cannot leave the event in a state the other processes would block on forever. The segment is
+// initialised under an advisory lock that the kernel drops with its holder, by whichever process finds it unpublished:
+// a creator dying half way leaves a segment that the next process to open the name takes over.
+class SingleSharedEvent
+{
+protected:
+	// use this clock so that all value of duration are accepted (lowest is nano, only used by the high res clock)
+	using clock = std::chrono::high_resolution_clock;
+
+	static constexpr uint32_t magic_ready = 0x53457631;	// "SEv1"
+
+	struct Segment {
+		std::atomic<uint32_t> magic;	// written last by the initialising process
+		std::atomic<uint32_t> state;	// futex word: 0 reset, 1 set
+		std::atomic<uint32_t> waiters;	// only used to skip the wake syscall; a dead waiter leaves it high, which costs a syscall, nothing more
+		uint32_t manual_reset;
+	};
+	static_assert(std::atomic<uint32_t>::is_always_lock_free, "process-shared futex words must be lock free");
+
+	Segment* seg{ nullptr };
+	int fd{ -1 };
+	std::string name;
+
+	static std::string shm_name(const std::string& n) {
+		return (!n.empty() && n[0] == '/') ? n : "/" + n;
+	}
+
+	static long futex(std::atomic<uint32_t>* word, int op, uint32_t val, const timespec* ts = nullptr, uint32_t val3 = 0) {
+		return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, val, ts, nullptr, val3);
+	}
+
+	void printError(const char* what) {
+		std::string strerr = "Error code: " + std::to_string(errno) + ", msg: " + std::strerror(errno);
+		fprintf(stderr, "Failed to %s shared event \"%s\". Error message: %s\n", what, name.c_str(), strerr.c_str());
+	}
+
+	// true if 'fd' is still the segment the name refers to, not one unlinked by a process that failed to initialise it
+	bool is_named() {
+		int named_fd = shm_open(name.c_str(), O_RDWR, 0666);
+		if (named_fd < 0)
+			return false;
+		struct stat mine {}, named {};
+		bool same = fstat(fd, &mine) == 0 && fstat(named_fd, &named) == 0 && mine.st_dev == named.st_dev && mine.st_ino == named.st_ino;
+		close(named_fd);
+		return same;
+	}
+
+	// Sizes, maps and publishes the segment unless already done; call with the lock held. An unpublished segment is
+	// unlinked on failure, so that the next opener starts from a fresh one.
+	Segment* map_segment(bool manual_reset) {
+		struct stat st {};
+		if (fstat(fd, &st) != 0) {
+			printError("open");
+			return nullptr;
+		}
+		bool sized = st.st_size >= (off_t)sizeof(Segment);
+		if (!sized && ftruncate(fd, sizeof(Segment)) != 0) {
+			printError("size");
+			shm_unlink(name.c_str());
+			return nullptr;
+		}
+
+		void* p = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (MAP_FAILED == p) {
+			printError("map");
+			if (!sized)
+				shm_unlink(name.c_str());
+			return nullptr;
+		}
+		Segment* s = static_cast<Segment*>(p);
+
+		if (s->magic.load(std::memory_order_acquire) != magic_ready) {
+			// created here, or left unpublished by a process that died: nobody can be waiting on it yet
+			s->state.store(0, std::memory_order_relaxed);
+			s->waiters.store(0, std::memory_order_relaxed);
+			s->manual_reset = manual_reset ? 1 : 0;
+			s->magic.store(magic_ready, std::memory_order_release);
+		}
+		else if (s->manual_reset != (manual_reset ? 1u : 0u)) {
+			errno = EINVAL;
+			printError("open (reset mode mismatch)");
+			munmap(p, sizeof(Segment));
+			return nullptr;
+		}
+		return s;
+	}
+
+	void open(bool manual_reset) {
+		for (int attempt = 0; attempt < 3; ++attempt) {
+			fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0666);
+			if (fd < 0)
+				return printError("open");
+
+			// held only while the segment is checked and initialised
+			while (flock(fd, LOCK_EX) != 0) {
+				if (errno != EINTR) {
+					printError("lock");
+					close(fd);
+					fd = -1;
+					return;
+				}
+			}
+			if (!is_named()) {
+				// unlinked while this process waited for the lock: open the name again
+				close(fd);
+				fd = -1;
+				continue;
+			}
+			seg = map_segment(manual_reset);
+			flock(fd, LOCK_UN);
+			if (!seg) {
+				close(fd);
+				fd = -1;
+			}
+			return;
+		}
+		errno = EAGAIN;
+		printError("open");
+	}
+
+	bool try_consume() {
+		if (seg->manual_reset)
+			return (1 == seg->state.load(std::memory_order_acquire));
+		uint32_t expected = 1;
+		return seg->state.compare_exchange_strong(expected, 0, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	// blocks while the state is 0, until 'deadline' (CLOCK_MONOTONIC) if given
+	void block(const timespec* deadline) {
+		seg->waiters.fetch_add(1, std::memory_order_seq_cst);
+		if (0 == seg->state.load(std::memory_order_seq_cst))
+			futex(&seg->state, FUTEX_WAIT_BITSET, 0, deadline, FUTEX_BITSET_MATCH_ANY);
+		seg->waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// CLOCK_MONOTONIC time point 't' from now, saturated instead of overflowing
+	static timespec monotonic_after(clock::duration t) {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		auto secs = std::chrono::duration_cast<std::chrono::seconds>(t);
+		auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(t - secs);
+		if (secs.count() > (std::numeric_limits<time_t>::max() - ts.tv_sec - 1)) {
+			ts.tv_sec = std::numeric_limits<time_t>::max();
+			return ts;
+		}
+		ts.tv_sec += secs.count();
+		ts.tv_nsec += nsecs.count();
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_nsec -= 1000000000L;
+			ts.tv_sec += 1;
+		}
+		return ts;
+	}
+
+	// true if 'a' is not later than 'b'
+	static bool before(const timespec& a, const timespec& b) {
+		return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec <= b.tv_nsec);
+	}
+
+	SingleSharedEvent(const std::string& _name, bool manual_reset) : name(shm_name(_name)) {
+		open(manual_reset);
+	}
+
+public:
+	// Opens the event called '_name', creating it if no process did yet
+	SingleSharedEvent(const std::string& _name) : SingleSharedEvent(_name, true) {}
+	~SingleSharedEvent() {
+		if (seg)
+			munmap(seg, sizeof(Segment));
+		if (fd >= 0)
+			close(fd);
+	}
+	SingleSharedEvent(const SingleSharedEvent&) = delete;
+	SingleSharedEvent& operator=(const SingleSharedEvent&) = delete;
+
+	// Removes the name; processes that already opened the event keep using it
+	static bool unlink(const std::string& _name) {
+		return (0 == shm_unlink(shm_name(_name).c_str()));
+	}
+
+	// Check if the event was opened successfully
+	operator bool() const {
+		return (nullptr != seg);
+	}
+
+	bool wait() {
+		if (!seg)
+			return false;
+		// an auto-reset wake goes to a single process: if that one dies before consuming the state, the others
+		// would sleep on a set event, so blocked waiters re-check the state periodically
+		while (!try_consume()) {
+			timespec recheck = monotonic_after(std::chrono::milliseconds(100));
+			block(&recheck);
+		}
+		return true;
+	}
+
+	bool wait_for(clock::duration t) {
+		if (!seg)
+			return false;
+
+		timespec deadline = monotonic_after(t);
+		while (!try_consume()) {
+			timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (before(deadline, now))
+				return false;
+			// re-check periodically like wait(), a lost auto-reset wake must not cost the whole timeout
+			timespec recheck = monotonic_after(std::chrono::milliseconds(100));
+			block(before(deadline, recheck) ? &deadline : &recheck);
+		}
+		return true;
+	}
+
+	bool set() {
+		if (!seg)
+			return false;
+		seg->state.store(1, std::memory_order_seq_cst);
+		if (seg->waiters.load(std::memory_order_seq_cst) > 0)
+			futex(&seg->state, FUTEX_WAKE, seg->manual_reset ? INT_MAX : 1);
+		return true;
+	}
+
+	bool is_set() {
+		return seg && try_consume();
+	}
+
+	bool reset() {
+		if (!seg)
+			return false;
+		seg->state.store(0, std::memory_order_release);
+		return true;
+	}
+};
+
+// Like SingleSharedEvent, but the event is automatically reset on wait and each set() wakes a single waiter
+class SharedEvent : public SingleSharedEvent
+{
+public:
+	SharedEvent(const std::string& _name) : SingleSharedEvent(_name, false) {}
+};
+
+#endif
@@ -0,0 +1,192 @@
+#pragma once
+#include "SafeThread.h"
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <stdexcept>
+
+
+namespace Threading {
+
+	// Graph of tasks executed on a fixed set of SafeThread workers, without a thread blocking on a dependency.
+	// A node becomes ready when its last predecessor finished. When a node throws, the exception goes through the
+	// SafeThread exception handler path and every node depending on it, directly or not, is cancelled.
+	class TaskGraph
+	{
+	public:
+		using NodeId = size_t;
+		enum class State { Pending, Done, Failed, Cancelled };
+
+	private:
+		struct Node {
+			std::function<void()> task;
+			std::vector<NodeId> successors;
+			unsigned dependencies{ 0 };
+			std::atomic<unsigned> pending{ 0 };
+			std::atomic<bool> cancelled{ false };
+			std::atomic<State> state{ State::Pending };
+		};
+
+		std::deque<Node> nodes;	// deque: nodes are not movable and must keep their address
+
+		std::mutex q_mtx;
+		std::deque<Node*> ready;
+		Event ready_ev;
+		std::unique_ptr<SingleEvent> done_ev;
+		std::atomic<size_t> remaining{ 0 };
+		std::atomic<bool> stopping{ false };
+
+		// node being run by the current worker, for the exception handler which runs on the same thread
+		static inline thread_local Node* current{ nullptr };
+
+		void push(Node* n) {
+			{
+				std::unique_lock<std::mutex> lock(q_mtx);
+				ready.push_back(n);
+			}
+			ready_ev.set();
+		}
+
+		Node* pop() {
+			while (true) {
+				{
+					std::unique_lock<std::mutex> lock(q_mtx);
+					if (!ready.empty()) {
+						Node* n = ready.front();
+						ready.pop_front();
+						bool more = !ready.empty();
+						lock.unlock();
+						// a set() is consumed by a single worker: pass it on while there is work left
+						if (more)
+							ready_ev.set();
+						return n;
+					}
+				}
+				if (stopping.load(std::memory_order_acquire)) {
+					ready_ev.set();
+					return nullptr;
+				}
+				ready_ev.wait();
+			}
+		}
+
+		void finish(Node* n, State st) {
+			n->state.store(st, std::memory_order_release);
+			for (auto id : n->successors) {
+				Node& succ = nodes[id];
+				if (State::Done != st)
+					succ.cancelled.store(true, std::memory_order_relaxed);
+				if (1 == succ.pending.fetch_sub(1, std::memory_order_acq_rel))
+					push(&succ);
+			}
+			if (1 == remaining.fetch_sub(1, std::memory_order_acq_rel))
+				done_ev->set();
+		}
+
+		void worker_loop() {
+			while (Node* n = pop()) {
+				if (n->cancelled.load(std::memory_order_relaxed)) {
+					finish(n, State::Cancelled);
+					continue;
+				}
+				current = n;
+				n->task();
+				current = nullptr;
+				finish(n, State::Done);
+			}
+		}
+
+		bool is_acyclic() const {
+			std::vector<unsigned> pend(nodes.size());
+			std::vector<NodeId> stack;
+			for (NodeId i = 0; i < nodes.size(); ++i) {
+				pend[i] = nodes[i].dependencies;
+				if (0 == pend[i])
+					stack.push_back(i);
+			}
+			size_t visited = 0;
+			while (!stack.empty()) {
+				NodeId i = stack.back();
+				stack.pop_back();
+				++visited;
+				for (auto s : nodes[i].successors)
+					if (0 == --pend[s])
+						stack.push_back(s);
+			}
+			return visited == nodes.size();
+		}
+
+	public:
+		TaskGraph() {}
+		TaskGraph(const TaskGraph&) = delete;
+		TaskGraph& operator=(const TaskGraph&) = delete;
+
+		NodeId add(std::function<void()> task) {
+			nodes.emplace_back();
+			nodes.back().task = std::move(task);
+			return nodes.size() - 1;
+		}
+
+		// 'after' becomes ready only once 'before' finished
+		void precede(NodeId before, NodeId after) {
+			nodes.at(before).successors.push_back(after);
+			nodes.at(after).dependencies++;
+		}
+
+		State state(NodeId id) const {
+			return nodes.at(id).state.load(std::memory_order_acquire);
+		}
+
+		// Executes the whole graph on 'workers' SafeThreads and returns once every node is done, failed or cancelled.
+		// 'exh' is called for every failing node, on the worker that ran it; the worker then continues with the graph.
+		// Returns true if every node succeeded. The graph may be run again, but not concurrently.
+		bool run(unsigned workers = std::thread::hardware_concurrency(),
+			const SafeThread::ExceptionHandler& exh = SafeThread::ExceptionHandler(SafeThread::defaultExHandler))
+		{
+			if (!is_acyclic())
+				throw std::invalid_argument("TaskGraph::run: the graph has a cycle");
+			if (nodes.empty())
+				return true;
+
+			done_ev = std::make_unique<SingleEvent>();
+			stopping.store(false, std::memory_order_relaxed);
+			remaining.store(nodes.size(), std::memory_order_relaxed);
+			for (auto& n : nodes) {
+				n.pending.store(n.dependencies, std::memory_order_relaxed);
+				n.cancelled.store(false, std::memory_order_relaxed);
+				n.state.store(State::Pending, std::memory_order_relaxed);
+			}
+			for (auto& n : nodes)
+				if (0 == n.dependencies)
+					push(&n);
+
+			auto user_handler = exh.get();
+			SafeThread::ExceptionHandler worker_handler([this, user_handler](SafeThread& t, tracked_exception& ex) {
+				Node* n = current;
+				current = nullptr;
+				if (user_handler)
+					user_handler(t, ex);
+				if (n)
+					finish(n, State::Failed);
+				// reenter the worker loop
+				return true;
+			});
+
+			std::vector<std::unique_ptr<SafeThread>> threads;
+			workers = std::max(workers, 1u);
+			for (unsigned i = 0; i < workers; ++i)
+				threads.push_back(std::make_unique<SafeThread>(L"TaskGraph worker " + std::to_wstring(i), worker_handler, [this]() { worker_loop(); }));
+
+			done_ev->wait();
+			stopping.store(true, std::memory_order_release);
+			ready_ev.set();
+			threads.clear();
+
+			for (auto& n : nodes)
+				if (State::Done != n.state.load(std::memory_order_relaxed))
+					return false;
+			return true;
+		}
+	};
+}
@@ -0,0 +1,258 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+
+namespace Threading {
+
+	// Keeps the OS threads of joined SafeThreads and hands them to the next launches, which then cost a wake-up instead
+	// of a thread creation. Disabled by default.
+	// The thread function of a SafeThread unwinds its stack and clears the thread_local state of this library (fault
+	// scopes, event and RCU registrations) before the thread is cached; thread_local objects of user code live on.
+	class ThreadCache
+	{
+	public:
+		struct Stats {
+			uint64_t created;	// OS threads started
+			uint64_t reused;	// launches served by a cached thread
+			size_t idle;		// threads waiting in the cache
+		};
+
+	private:
+		struct Job {
+			virtual ~Job() {}
+			virtual void run() = 0;
+		};
+
+		template<typename F, typename Tuple>
+		struct JobImpl : Job {
+			F f;
+			Tuple args;
+			JobImpl(F&& _f, Tuple&& _args) : f(std::move(_f)), args(std::move(_args)) {}
+			void run() override { std::apply(std::move(f), std::move(args)); }
+		};
+
+		// a cached OS thread; its condition variable is private on purpose, idle threads must not look blocked
+		// to the wait-for graph
+		struct Worker {
+			std::mutex mtx;
+			std::condition_variable cv;
+			std::unique_ptr<Job> job;
+			bool busy{ false };		// a job was handed over and has not returned yet
+			bool retire{ false };
+			std::thread thread;
+			std::thread::id id;
+		};
+
+		static inline std::atomic<bool> enabled{ false };
+
+		std::mutex mtx;
+		std::vector<std::shared_ptr<Worker>> idle;		// most recently used last
+		std::vector<std::shared_ptr<Worker>> retired;	// exited on idle timeout, joined by the next launch
+		size_t max_idle{ 64 };
+		std::chrono::milliseconds idle_timeout{ 10000 };
+		uint64_t n_created{ 0 };
+		uint64_t n_reused{ 0 };
+
+		static void worker_main(Worker* w) {
+			ThreadCache& c = inst();
+			std::unique_lock<std::mutex> lock(w->mtx);
+			while (true) {
+				while (!w->job && !w->retire) {
+					std::chrono::milliseconds timeout;
+					{
+						std::unique_lock<std::mutex> cache_lock(c.mtx);
+						timeout = c.idle_timeout;
+					}
+					if (std::cv_status::timeout == w->cv.wait_for(lock, timeout) && !w->job && !w->retire) {
+						lock.unlock();
+						if (c.retire_idle(w))
+							return;
+						lock.lock();
+					}
+				}
+				if (!w->job)
+					return;
+
+				auto job = std::move(w->job);
+				lock.unlock();
+				job->run();
+				job.reset();
+				lock.lock();
+				w->busy = false;
+				w->cv.notify_all();
+			}
+		}
+
+		// called by an idle worker that timed out; false if it was taken for a launch meanwhile
+		bool retire_idle(Worker* w) {
+			std::unique_lock<std::mutex> lock(mtx);
+			for (auto it = idle.begin(); it != idle.end(); ++it) {
+				if (it->get() == w) {
+					retired.push_back(std::move(*it));
+					idle.erase(it);
+					return true;
+				}
+			}
+			return false;
+		}
+
+		std::shared_ptr<Worker> acquire(std::unique_ptr<Job> job) {
+			std::shared_ptr<Worker> w;
+			std::vector<std::shared_ptr<Worker>> done;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				if (!idle.empty()) {
+					w = std::move(idle.back());
+					idle.pop_back();
+					++n_reused;
+				}
+				else
+					++n_created;
+				done.swap(retired);
+			}
+			for (auto& r : done)
+				r->thread.join();
+
+			if (w) {
+				{
+					std::unique_lock<std::mutex> lock(w->mtx);
+					w->job = std::move(job);
+					w->busy = true;
+				}
+				w->cv.notify_all();
+				return w;
+			}
+
+			w = std::make_shared<Worker>();
+			w->job = std::move(job);
+			w->busy = true;
+			w->thread = std::thread(&ThreadCache::worker_main, w.get());
+			w->id = w->thread.get_id();
+			return w;
+		}
+
+		// waits for the job of 'w', then caches the thread, or stops it if the cache is full or disabled
+		void release(const std::shared_ptr<Worker>& w) {
+			{
+				std::unique_lock<std::mutex> lock(w->mtx);
+				w->cv.wait(lock, [&]() { return !w->busy; });
+			}
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				if (is_enabled() && idle.size() < max_idle) {
+					idle.push_back(w);
+					return;
+				}
+			}
+			{
+				std::unique_lock<std::mutex> lock(w->mtx);
+				w->retire = true;
+			}
+			w->cv.notify_all();
+			w->thread.join();
+		}
+
+		friend class ThreadHandle;
+
+	public:
+		// never destroyed: SafeThreads with static storage may still return their thread during exit
+		static ThreadCache& inst() {
+			static ThreadCache* c = new ThreadCache;
+			return *c;
+		}
+
+		static void enable(bool on = true) {
+			enabled.store(on, std::memory_order_relaxed);
+		}
+		static bool is_enabled() {
+			return enabled.load(std::memory_order_relaxed);
+		}
+
+		// at most 'max_idle' threads are kept, each for at most 'timeout' without a launch
+		void configure(size_t _max_idle, std::chrono::milliseconds timeout) {
+			std::vector<std::shared_ptr<Worker>> waiting;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				max_idle = _max_idle;
+				idle_timeout = timeout;
+				waiting = idle;
+			}
+			// idle threads wait with the previous timeout, wake them up to pick the new one
+			for (auto& w : waiting) {
+				{
+					std::unique_lock<std::mutex> lock(w->mtx);
+				}
+				w->cv.notify_all();
+			}
+		}
+
+		Stats stats() {
+			std::unique_lock<std::mutex> lock(mtx);
+			return { n_created, n_reused, idle.size() };
+		}
+	};
+
+	// The thread of a SafeThread: a std::thread, or a thread leased from the ThreadCache, with the std::thread semantics
+	// of join(), joinable(), get_id() and native_handle(). A leased thread goes back to the cache when joined.
+	class ThreadHandle
+	{
+		std::thread thread;
+		std::shared_ptr<ThreadCache::Worker> worker;
+
+	public:
+		ThreadHandle() noexcept {}
+		ThreadHandle(ThreadHandle&& t) noexcept : thread(std::move(t.thread)), worker(std::move(t.worker)) {}
+		ThreadHandle& operator=(ThreadHandle&& t) noexcept {
+			if (joinable())
+				std::terminate();
+			thread = std::move(t.thread);
+			worker = std::move(t.worker);
+			return *this;
+		}
+		~ThreadHandle() {
+			if (joinable())
+				std::terminate();
+		}
+
+		template<typename F, typename... Args>
+		void launch(F&& f, Args&&... args) {
+			if (ThreadCache::is_enabled()) {
+				using Tuple = decltype(std::make_tuple(std::forward<Args>(args)...));
+				using Fn = typename std::decay<F>::type;
+				worker = ThreadCache::inst().acquire(std::make_unique<ThreadCache::JobImpl<Fn, Tuple>>(Fn(std::forward<F>(f)), std::make_tuple(std::forward<Args>(args)...)));
+			}
+			else
+				thread = std::thread(std::forward<F>(f), std::forward<Args>(args)...);
+		}
+
+		bool joinable() const noexcept {
+			return thread.joinable() || nullptr != worker;
+		}
+
+		void join() {
+			if (nullptr == worker)
+				return thread.join();
+			if (std::this_thread::get_id() == worker->id)
+				throw std::system_error(std::make_error_code(std::errc::resource_deadlock_would_occur));
+			ThreadCache::inst().release(worker);
+			worker.reset();
+		}
+
+		std::thread::id get_id() const noexcept {
+			return worker ? worker->id : thread.get_id();
+		}
+
+		std::thread::native_handle_type native_handle() {
+			return worker ? worker->thread.native_handle() : thread.native_handle();
+		}
+	};
+}
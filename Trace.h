@@ -0,0 +1,232 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <ostream>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+
+
+namespace Tracing {
+
+	enum class Point : uint8_t {
+		// SafeThread lifecycle, 'object' is the thread; Exception and Reenter are also recorded for fibers
+		Launch,
+		Unfreeze,
+		FirstRun,
+		Exception,
+		Reenter,
+		Exit,
+		// SingleEvent transitions, 'object' is the event
+		EventSet,
+		WaitBegin,
+		WaitWake,
+		WaitTimeout
+	};
+
+	struct Record {
+		int64_t ts_ns;
+		const void* object;
+		Point point;
+		uint32_t generation;	// number of Recorder::clear() calls before it was recorded
+	};
+
+	// Timeline recorder: each thread appends to its own ring buffer, without locks or atomic read-modify-write,
+	// and keeps only the latest 'capacity' records. Disabled by default, in which case record() is a relaxed load.
+	class Recorder
+	{
+		struct Buffer {
+			static constexpr size_t capacity = 1 << 14;
+
+			std::atomic<uint64_t> head{ 0 };
+			Record records[capacity];
+			uint32_t tid{ 0 };
+			std::atomic<bool> dead{ false };	// its thread exited
+			std::mutex name_mtx;
+			std::string name;
+		};
+
+		struct ThreadBuffer {
+			Buffer* b{ nullptr };
+			~ThreadBuffer() {
+				if (b)
+					b->dead.store(true, std::memory_order_release);
+			}
+		};
+
+		static inline std::atomic<bool> enabled{ false };
+		// Bumped by clear() instead of rewinding the buffers, whose heads only their threads write: records of an
+		// older generation are ignored by the export
+		static inline std::atomic<uint32_t> generation{ 0 };
+
+		std::mutex buffers_mtx;
+		std::vector<std::shared_ptr<Buffer>> buffers;	// kept after their thread exited, until cleared or exported
+		uint32_t next_tid{ 1 };
+
+		static Buffer* buffer() {
+			static thread_local ThreadBuffer tls_buffer;
+			if (nullptr == tls_buffer.b) {
+				auto b = std::make_shared<Buffer>();
+				Recorder& r = inst();
+				std::unique_lock<std::mutex> lock(r.buffers_mtx);
+				b->tid = r.next_tid++;
+				r.buffers.push_back(b);
+				tls_buffer.b = b.get();
+			}
+			return tls_buffer.b;
+		}
+
+		static void json_escape(std::ostream& os, const std::string& s) {
+			for (char c : s) {
+				if (c == '"' || c == '\\')
+					os << '\\' << c;
+				else if ((unsigned char)c < 0x20)
+					os << ' ';
+				else
+					os << c;
+			}
+		}
+
+	public:
+		static Recorder& inst() {
+			static Recorder r;
+			return r;
+		}
+
+		static void enable(bool on = true) {
+			enabled.store(on, std::memory_order_relaxed);
+		}
+		static bool is_enabled() {
+			return enabled.load(std::memory_order_relaxed);
+		}
+
+		static void record(Point p, const void* object) {
+			if (!enabled.load(std::memory_order_relaxed))
+				return;
+			Buffer* b = buffer();
+			uint64_t h = b->head.load(std::memory_order_relaxed);
+			Record& r = b->records[h & (Buffer::capacity - 1)];
+			r.generation = generation.load(std::memory_order_relaxed);
+			r.ts_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			r.object = object;
+			r.point = p;
+			b->head.store(h + 1, std::memory_order_release);
+		}
+
+		// name shown for the calling thread in the exported timeline
+		static void set_thread_name(const std::wstring& wname) {
+			if (!enabled.load(std::memory_order_relaxed))
+				return;
+			std::string n;
+			n.reserve(wname.size());
+			for (wchar_t c : wname)
+				n.push_back((c > 0 && c < 0x80) ? (char)c : '?');
+			Buffer* b = buffer();
+			std::unique_lock<std::mutex> lock(b->name_mtx);
+			b->name = std::move(n);
+		}
+
+		// call with buffers_mtx held
+		void drop_dead_buffers() {
+			buffers.erase(std::remove_if(buffers.begin(), buffers.end(),
+				[](const std::shared_ptr<Buffer>& b) { return b->dead.load(std::memory_order_acquire); }), buffers.end());
+		}
+
+		// Drops every record and frees the buffers of exited threads; buffers of live threads are reused
+		void clear() {
+			std::unique_lock<std::mutex> lock(buffers_mtx);
+			drop_dead_buffers();
+			generation.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev). Event sets are linked to the wake-ups they cause
+		// and thread launches to their first run with flow arrows. Records still being written while exporting may be
+		// inconsistent: disable the recorder first for an exact dump.
+		// The buffers of exited threads are freed once exported.
+		void write_chrome_json(std::ostream& os) {
+			std::unique_lock<std::mutex> lock(buffers_mtx);
+			uint32_t current = generation.load(std::memory_order_relaxed);
+			os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+			bool first = true;
+			auto begin_event = [&]() -> std::ostream& {
+				if (!first)
+					os << ",\n";
+				first = false;
+				return os;
+			};
+
+			for (auto& b : buffers) {
+				{
+					std::unique_lock<std::mutex> name_lock(b->name_mtx);
+					begin_event() << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << b->tid << ",\"args\":{\"name\":\"";
+					json_escape(os, b->name.empty() ? "thread " + std::to_string(b->tid) : b->name);
+					os << "\"}}";
+				}
+
+				uint64_t h = b->head.load(std::memory_order_acquire);
+				uint64_t i = (h > Buffer::capacity) ? h - Buffer::capacity : 0;
+				for (; i < h; ++i) {
+					const Record& r = b->records[i & (Buffer::capacity - 1)];
+					if (r.generation != current)
+						continue;
+					char ts[32], id[32];
+					snprintf(ts, sizeof(ts), "%lld.%03lld", (long long)(r.ts_ns / 1000), (long long)(r.ts_ns % 1000));
+					snprintf(id, sizeof(id), "0x%llx", (unsigned long long)(uintptr_t)r.object);
+					auto common = [&](const char* ph, const char* name, const char* cat) -> std::ostream& {
+						return begin_event() << "{\"ph\":\"" << ph << "\",\"name\":\"" << name << "\",\"cat\":\"" << cat
+							<< "\",\"pid\":1,\"tid\":" << b->tid << ",\"ts\":" << ts;
+					};
+					auto instant = [&](const char* name, const char* cat) {
+						common("i", name, cat) << ",\"s\":\"t\",\"args\":{\"object\":\"" << id << "\"}}";
+					};
+					auto flow = [&](const char* ph, const char* cat) {
+						common(ph, "causality", cat) << ",\"id\":\"" << id << "\"" << (ph[0] == 'f' ? ",\"bp\":\"e\"" : "") << "}";
+					};
+
+					switch (r.point) {
+					case Point::Launch:
+						instant("launch", "thread");
+						flow("s", "thread");
+						break;
+					case Point::Unfreeze:
+						instant("unfreeze", "thread");
+						break;
+					case Point::FirstRun:
+						flow("f", "thread");
+						common("B", "run", "thread") << ",\"args\":{\"thread\":\"" << id << "\"}}";
+						break;
+					case Point::Exception:
+						instant("exception", "thread");
+						break;
+					case Point::Reenter:
+						instant("reenter", "thread");
+						break;
+					case Point::Exit:
+						common("E", "run", "thread") << "}";
+						break;
+					case Point::EventSet:
+						instant("set", "event");
+						flow("s", "event");
+						break;
+					case Point::WaitBegin:
+						common("B", "wait", "event") << ",\"args\":{\"event\":\"" << id << "\"}}";
+						break;
+					case Point::WaitWake:
+						flow("f", "event");
+						common("E", "wait", "event") << ",\"args\":{\"result\":\"woken\"}}";
+						break;
+					case Point::WaitTimeout:
+						common("E", "wait", "event") << ",\"args\":{\"result\":\"timeout\"}}";
+						break;
+					}
+				}
+			}
+			os << "\n]}\n";
+			drop_dead_buffers();
+		}
+	};
+}
@@ -1,5 +1,6 @@
 #include <type_traits>
 #include <string>
+#include <functional>
 
 
 
@@ -21,9 +22,9 @@ struct extract_char_type<const std::basic_string<C>&> : std::true_type { typedef
 
 
 template<typename T,
-	typename Strip = std::decay<T>::type,
-	typename C = std::conditional<extract_char_type<Strip>::value,
-	extract_char_type<Strip>::char_type, Strip>::type>
+	typename Strip = typename std::decay<T>::type,
+	typename C = typename std::conditional<extract_char_type<Strip>::value,
+	typename extract_char_type<Strip>::char_type, Strip>::type>
 	struct is_string {
 	typedef typename std::conditional<
 		std::is_same<typename std::decay<typename std::remove_pointer<typename std::decay<C>::type>::type>::type, char>::value ||
@@ -51,5 +52,5 @@ struct is_primitive_string {
 	>::type type;
 	static constexpr typename type::value_type value = type::value;
 	using char_type = typename std::decay<typename std::remove_pointer<typename std::decay<Str>::type>::type>::type;
-	using input_type = typename Str;
+	using input_type = Str;
 };
@@ -0,0 +1,288 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+
+namespace Deadlock {
+
+	// Wait-for graph between threads and events: which thread is blocked on which event, and which thread is expected
+	// to set each event (annotated owner, or else the thread that set it last). A fiber parked on an event is a node of
+	// its own, apart from its carrier thread and the other fibers of that carrier.
+	// Disabled by default, in which case every hook is a relaxed load; when enabled, each wait and set takes a global lock.
+	class WaitGraph
+	{
+	public:
+		using clock = std::chrono::steady_clock;
+
+		// a thread, or a fiber (whatever thread carries it)
+		struct Node {
+			std::thread::id thread;
+			const void* fiber{ nullptr };
+
+			bool operator==(const Node& o) const { return thread == o.thread && fiber == o.fiber; }
+			bool operator!=(const Node& o) const { return !(*this == o); }
+			bool operator<(const Node& o) const { return fiber != o.fiber ? std::less<const void*>()(fiber, o.fiber) : thread < o.thread; }
+		};
+
+		struct Report {
+			// Cycle: every edge is an annotated owner. SuspectedCycle: some edges are guessed from the last setter of
+			// the event, lower confidence.
+			enum class Kind { Cycle, SuspectedCycle, LongBlocked };
+			Kind kind;
+			std::vector<Node> chain;	// threads and fibers involved, in wait order
+			std::wstring text;
+		};
+
+	private:
+		struct NodeHash {
+			size_t operator()(const Node& n) const {
+				return std::hash<std::thread::id>()(n.thread) ^ std::hash<const void*>()(n.fiber);
+			}
+		};
+
+		struct NodeInfo {
+			std::wstring name;
+			const void* blocked_on{ nullptr };
+			clock::time_point since;
+		};
+
+		static inline std::atomic<bool> enabled{ false };
+
+		std::mutex mtx;
+		std::unordered_map<Node, NodeInfo, NodeHash> nodes;
+		std::unordered_map<const void*, Node> owners;
+		std::unordered_map<const void*, Node> last_setters;
+
+		// the calling thread, or 'fiber' running on it
+		static Node self(const void* fiber) {
+			return fiber ? Node{ std::thread::id(), fiber } : Node{ std::this_thread::get_id(), nullptr };
+		}
+
+		std::wstring name_of(const Node& n) {
+			auto it = nodes.find(n);
+			if (it != nodes.end() && !it->second.name.empty())
+				return L"\"" + it->second.name + L"\"";
+			std::wstringstream wss;
+			if (n.fiber)
+				wss << L"fiber " << n.fiber;
+			else
+				wss << L"thread " << n.thread;
+			return wss.str();
+		}
+
+		void forget(const Node& n) {
+			nodes.erase(n);
+			for (auto it = last_setters.begin(); it != last_setters.end();)
+				it = (it->second == n) ? last_setters.erase(it) : std::next(it);
+		}
+
+		// Node expected to set 'ev' for 'waiter', if known. 'annotated' tells a declared owner from a guess based on
+		// the last setter; a waiter is never its own guessed setter (workers passing a wake-up on, then waiting again).
+		bool setter_of(const void* ev, const Node& waiter, Node& id, bool& annotated) {
+			auto it = owners.find(ev);
+			annotated = (it != owners.end());
+			if (!annotated) {
+				it = last_setters.find(ev);
+				if (it == last_setters.end() || it->second == waiter)
+					return false;
+			}
+			id = it->second;
+			return true;
+		}
+
+	public:
+		static WaitGraph& inst() {
+			static WaitGraph g;
+			return g;
+		}
+
+		static void enable(bool on = true) {
+			enabled.store(on, std::memory_order_relaxed);
+		}
+		static bool is_enabled() {
+			return enabled.load(std::memory_order_relaxed);
+		}
+
+		static void set_thread_name(std::thread::id id, const std::wstring& name) {
+			if (!is_enabled())
+				return;
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			g.nodes[Node{ id, nullptr }].name = name;
+		}
+		static void set_fiber_name(const void* fiber, const std::wstring& name) {
+			if (!is_enabled())
+				return;
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			g.nodes[Node{ std::thread::id(), fiber }].name = name;
+		}
+
+		static void forget_thread(std::thread::id id) {
+			if (!is_enabled())
+				return;
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			g.forget(Node{ id, nullptr });
+		}
+		static void forget_fiber(const void* fiber) {
+			if (!is_enabled())
+				return;
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			g.forget(Node{ std::thread::id(), fiber });
+		}
+
+		// Declares 'owner' as the thread that will set 'ev'; takes precedence over the last setter
+		static void set_owner(const void* ev, std::thread::id owner) {
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			g.owners[ev] = Node{ owner, nullptr };
+		}
+		// same with a fiber as the owner
+		static void set_fiber_owner(const void* ev, const void* fiber) {
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			g.owners[ev] = Node{ std::thread::id(), fiber };
+		}
+		static void clear_owner(const void* ev) {
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			g.owners.erase(ev);
+		}
+
+		// 'fiber' is the fiber waiting or setting on the calling thread, if any
+		static void begin_wait(const void* ev, const void* fiber = nullptr) {
+			if (!is_enabled())
+				return;
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			auto& t = g.nodes[self(fiber)];
+			t.blocked_on = ev;
+			t.since = clock::now();
+		}
+
+		static void end_wait(const void* fiber = nullptr) {
+			if (!is_enabled())
+				return;
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			auto it = g.nodes.find(self(fiber));
+			if (it != g.nodes.end())
+				it->second.blocked_on = nullptr;
+		}
+
+		static void on_set(const void* ev, const void* fiber = nullptr) {
+			if (!is_enabled())
+				return;
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			g.last_setters[ev] = self(fiber);
+		}
+
+		static void forget_event(const void* ev) {
+			if (!is_enabled())
+				return;
+			WaitGraph& g = inst();
+			std::unique_lock<std::mutex> lock(g.mtx);
+			g.owners.erase(ev);
+			g.last_setters.erase(ev);
+		}
+
+		// Follows each blocked node to the node expected to release it. Reports every cycle once: as a Cycle when all its
+		// owners are annotated, as a SuspectedCycle when some are guessed from the last setter. Reports every other chain
+		// with an annotated owner whose first node has been blocked for longer than 'long_block'; guessed setters alone
+		// do not make a long blocked chain, since a thread idling on a work queue looks the same as a stuck one.
+		std::vector<Report> check(clock::duration long_block) {
+			std::vector<Report> reports;
+			std::unique_lock<std::mutex> lock(mtx);
+			auto now = clock::now();
+			std::unordered_set<Node, NodeHash> in_reported_cycle;
+
+			for (auto& start : nodes) {
+				if (nullptr == start.second.blocked_on || in_reported_cycle.count(start.first))
+					continue;
+
+				std::vector<Node> chain{ start.first };
+				std::unordered_map<Node, size_t, NodeHash> pos{ { start.first, 0 } };
+				std::vector<bool> annotated;	// per edge chain[i] -> chain[i + 1], and the edge closing a cycle
+				Node cur = start.first;
+				bool cycle = false;
+				size_t cycle_start = 0;
+
+				while (true) {
+					auto it = nodes.find(cur);
+					Node next;
+					bool owned;
+					if (it == nodes.end() || nullptr == it->second.blocked_on || !setter_of(it->second.blocked_on, cur, next, owned))
+						break;
+					auto seen = pos.find(next);
+					if (seen != pos.end()) {
+						cycle = true;
+						cycle_start = seen->second;
+						annotated.push_back(owned);
+						break;
+					}
+					annotated.push_back(owned);
+					pos[next] = chain.size();
+					chain.push_back(next);
+					cur = next;
+				}
+				bool any_annotated = std::find(annotated.begin(), annotated.end(), true) != annotated.end();
+				bool certain = cycle && std::all_of(annotated.begin() + cycle_start, annotated.end(), [](bool a) { return a; });
+
+				auto describe = [&](size_t from, size_t to, const std::wstring& last_setter) {
+					std::wstringstream wss;
+					for (size_t i = from; i < to; ++i) {
+						if (i != from)
+							wss << L"; ";
+						auto it = nodes.find(chain[i]);
+						if (it == nodes.end() || nullptr == it->second.blocked_on) {
+							wss << name_of(chain[i]) << L" is not blocked";
+							continue;
+						}
+						auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - it->second.since).count();
+						wss << name_of(chain[i]) << L" waits (" << ms << L" ms) on event " << it->second.blocked_on << L" expected from ";
+						wss << ((i + 1 < to) ? name_of(chain[i + 1]) : last_setter);
+					}
+					return wss.str();
+				};
+
+				Node cycle_entry = chain[cycle_start];
+				if (cycle) {
+					// same cycle, same report, whichever thread the walk started from
+					std::rotate(chain.begin() + cycle_start, std::min_element(chain.begin() + cycle_start, chain.end()), chain.end());
+				}
+
+				if (cycle && !in_reported_cycle.count(chain[cycle_start])) {
+					for (size_t i = cycle_start; i < chain.size(); ++i)
+						in_reported_cycle.insert(chain[i]);
+					reports.push_back({ certain ? Report::Kind::Cycle : Report::Kind::SuspectedCycle,
+						std::vector<Node>(chain.begin() + cycle_start, chain.end()),
+						(certain ? L"Deadlock: " : L"Suspected deadlock, setters guessed from the last set(): ")
+						+ describe(cycle_start, chain.size(), name_of(chain[cycle_start])) });
+				}
+				// a chain leading into a cycle is reported on its own
+				if ((!cycle || cycle_start > 0) && any_annotated && now - start.second.since > long_block) {
+					std::wstring text = cycle ?
+						describe(0, cycle_start, name_of(cycle_entry) + L", which is deadlocked") :
+						describe(0, chain.size(), L"no known thread");
+					if (cycle) {
+						chain.resize(cycle_start);
+						chain.push_back(cycle_entry);
+					}
+					reports.push_back({ Report::Kind::LongBlocked, chain, L"Long blocked chain: " + text });
+				}
+			}
+			return reports;
+		}
+	};
+}
@@ -0,0 +1,109 @@
+// Idle pool workers must not be reported as deadlocked. An annotated cycle must, a cycle of guessed setters as a
+// suspected one, and a cycle of fibers sharing a carrier as well.
+//	g++ -std=c++17 -O2 -I.. -I<logger.h dir> deadlock_idle_pools.cpp -pthread
+#include "../DeadlockChecker.h"
+#include "../DeadlinePool.h"
+#include "../TaskGraph.h"
+#include "../Fiber.h"
+#include <cstdio>
+#include <iostream>
+
+using namespace Threading;
+
+int main()
+{
+	std::mutex mtx;
+	std::vector<DeadlockChecker::Report> reports;
+	DeadlockChecker checker(std::chrono::milliseconds(20), std::chrono::milliseconds(50), [&](const DeadlockChecker::Report& r) {
+		std::unique_lock<std::mutex> lock(mtx);
+		reports.push_back(r);
+	});
+
+	{
+		WorkerPool pool(4);
+		DeadlinePool edf(4);
+		for (int i = 0; i < 100; ++i) {
+			pool.post([]() {});
+			edf.post([]() {});
+		}
+		TaskGraph graph;
+		auto slow = graph.add([]() { std::this_thread::sleep_for(std::chrono::milliseconds(300)); });
+		for (int i = 0; i < 10; ++i)
+			graph.precede(graph.add([]() {}), slow);
+		graph.run(4);
+	}
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		for (auto& r : reports)
+			std::wcout << L"unexpected: " << r.text << std::endl;
+		if (!reports.empty())
+			return 1;
+	}
+
+	auto seen = [&](DeadlockChecker::Report::Kind kind) {
+		std::unique_lock<std::mutex> lock(mtx);
+		bool found = std::any_of(reports.begin(), reports.end(), [&](const DeadlockChecker::Report& r) { return kind == r.kind; });
+		reports.clear();
+		return found;
+	};
+
+	{
+		SingleEvent a, b;
+		SafeThread A(std::wstring(L"A"), [&]() { Deadlock::WaitGraph::set_owner(&a, std::this_thread::get_id()); b.wait(); a.set(); });
+		SafeThread B(std::wstring(L"B"), [&]() { Deadlock::WaitGraph::set_owner(&b, std::this_thread::get_id()); a.wait(); b.set(); });
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		a.set();
+		b.set();
+	}
+	if (!seen(DeadlockChecker::Report::Kind::Cycle)) {
+		std::printf("annotated cycle not reported\n");
+		return 1;
+	}
+
+	// no annotation: each thread set the event the other waits on last
+	{
+		Event a, b;
+		std::atomic<int> ready{ 0 };
+		auto side = [&](Event& mine, Event& other) {
+			// set last by this thread; the signal is consumed right away
+			mine.set();
+			mine.wait();
+			ready.fetch_add(1);
+			while (ready.load() != 2)
+				std::this_thread::yield();
+			other.wait();
+		};
+		SafeThread A(std::wstring(L"C"), [&]() { side(a, b); });
+		SafeThread B(std::wstring(L"D"), [&]() { side(b, a); });
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		a.set();
+		b.set();
+	}
+	if (!seen(DeadlockChecker::Report::Kind::SuspectedCycle)) {
+		std::printf("guessed cycle not reported\n");
+		return 1;
+	}
+
+	// fibers parked on one carrier are nodes of their own: a sibling coming and going does not hide their cycle
+	{
+		FiberScheduler fibers(1);
+		SingleEvent x, y, z;
+		auto f1 = fibers.spawn(L"F1", [&]() { Deadlock::WaitGraph::set_fiber_owner(&x, FiberWaiter::current()); y.wait(); x.set(); });
+		auto f2 = fibers.spawn(L"F2", [&]() { Deadlock::WaitGraph::set_fiber_owner(&y, FiberWaiter::current()); x.wait(); y.set(); });
+		auto f3 = fibers.spawn(L"F3", [&]() { z.wait(); });
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		z.set();
+		f3->join();
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		x.set();
+		y.set();
+		f1->join();
+		f2->join();
+	}
+	if (!seen(DeadlockChecker::Report::Kind::Cycle)) {
+		std::printf("fiber cycle not reported\n");
+		return 1;
+	}
+	std::printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,129 @@
+// An Event wakes exactly one blocked waiter per set(), in the order of its wake policy. Then measures wakeups per
+// set() and the latency from set() to the return of wait() with N waiters contending for the signals.
+//	g++ -std=c++17 -O2 -I.. -I<logger.h dir> event_wake_stats.cpp -pthread
+#include "../Event.h"
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+static bool check(WakePolicy policy, const char* name)
+{
+	const int n = 8;
+	const int rounds = 3 * n;
+	Event ev(policy);
+	std::atomic<bool> stopping{ false };
+	std::atomic<int> woken{ -1 };
+	std::atomic<int> waiting{ 0 };
+	auto settle = []() { std::this_thread::sleep_for(std::chrono::milliseconds(5)); };
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < n; ++i) {
+		threads.emplace_back([&, i]() {
+			while (true) {
+				waiting.fetch_add(1);
+				ev.wait();
+				if (stopping.load())
+					return;
+				woken.store(i);
+			}
+		});
+		// block the waiters one after the other
+		while (waiting.load() != i + 1)
+			std::this_thread::yield();
+		settle();
+	}
+
+	bool ok = true;
+	for (int r = 0; r < rounds && ok; ++r) {
+		int expected = (WakePolicy::Fifo == policy) ? r % n : n - 1;
+		woken.store(-1);
+		ev.set();
+		// the woken thread records itself, then blocks again
+		while (waiting.load() != n + r + 1)
+			std::this_thread::yield();
+		settle();
+		Event::WakeStats st = ev.wake_stats();
+		if (woken.load() != expected || st.wakeups != st.sets) {
+			std::printf("%s round %d: woke %d, expected %d; %llu sets, %llu wakeups\n", name, r, woken.load(), expected, st.sets, st.wakeups);
+			ok = false;
+		}
+	}
+
+	stopping.store(true);
+	for (int i = 0; i < n; ++i)
+		ev.set();
+	for (auto& t : threads)
+		t.join();
+	return ok;
+}
+
+static bool bench(WakePolicy policy, const char* name, int n)
+{
+	using clock = std::chrono::steady_clock;
+	const int sets = 2000;
+	Event ev(policy);
+	std::atomic<bool> stopping{ false };
+	std::atomic<int> acked{ 0 };
+	std::atomic<int64_t> set_at{ 0 };
+	std::vector<std::vector<int64_t>> latencies(n);
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < n; ++i) {
+		threads.emplace_back([&, i]() {
+			while (true) {
+				ev.wait();
+				if (stopping.load())
+					return;
+				latencies[i].push_back(clock::now().time_since_epoch().count() - set_at.load());
+				acked.fetch_add(1);
+			}
+		});
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	auto start = clock::now();
+	for (int k = 0; k < sets; ++k) {
+		set_at.store(clock::now().time_since_epoch().count());
+		ev.set();
+		while (acked.load() != k + 1)
+			std::this_thread::yield();
+	}
+	double elapsed_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+	Event::WakeStats st = ev.wake_stats();
+
+	stopping.store(true);
+	for (int i = 0; i < n; ++i)
+		ev.set();
+	for (auto& t : threads)
+		t.join();
+
+	std::vector<int64_t> all;
+	int served = 0;
+	for (auto& l : latencies) {
+		all.insert(all.end(), l.begin(), l.end());
+		served += l.empty() ? 0 : 1;
+	}
+	std::sort(all.begin(), all.end());
+	double mean = 0;
+	for (int64_t ns : all)
+		mean += ns;
+	mean /= all.size();
+	std::printf("%s %2d waiters: %llu sets, %llu wakeups, %.3f wakeups/set, latency mean %.1f us p50 %.1f us p99 %.1f us, "
+		"%d waiters served, %.0f sets/s\n", name, n, st.sets, st.wakeups, (double)st.wakeups / st.sets, mean / 1000,
+		all[all.size() / 2] / 1000.0, all[all.size() * 99 / 100] / 1000.0, served, sets / elapsed_ms * 1000);
+	// the stop signals are not counted yet: every wakeup so far consumed one set()
+	return st.wakeups == st.sets;
+}
+
+int main()
+{
+	bool ok = check(WakePolicy::Fifo, "fifo");
+	ok = check(WakePolicy::Lifo, "lifo") && ok;
+	for (int n : { 2, 8, 32 }) {
+		ok = bench(WakePolicy::Fifo, "fifo", n) && ok;
+		ok = bench(WakePolicy::Lifo, "lifo", n) && ok;
+	}
+	std::printf(ok ? "ok\n" : "failed\n");
+	return ok ? 0 : 1;
+}
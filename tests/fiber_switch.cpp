@@ -0,0 +1,64 @@
+// Fiber context switch rate: fibers on one carrier yielding to each other, and fibers handing an Event back and forth.
+//	g++ -std=c++17 -O2 -I.. -I<logger.h dir> fiber_switch.cpp -pthread
+#include "../Fiber.h"
+#include <cstdio>
+
+using namespace Threading;
+
+int main()
+{
+	using clock = std::chrono::steady_clock;
+	bool ok = true;
+	FiberScheduler scheduler(1);
+
+	{
+		const int n_fibers = 4;
+		const int yields = 250000;
+		std::atomic<long> count{ 0 };
+		auto start = clock::now();
+		std::vector<std::shared_ptr<Fiber>> fibers;
+		for (int i = 0; i < n_fibers; ++i) {
+			fibers.push_back(scheduler.spawn([&]() {
+				for (int k = 0; k < yields; ++k) {
+					count.fetch_add(1, std::memory_order_relaxed);
+					Fiber::yield();
+				}
+			}));
+		}
+		for (auto& f : fibers)
+			f->join();
+		double s = std::chrono::duration<double>(clock::now() - start).count();
+		// a yield is two switches: to the carrier, then to the next fiber
+		std::printf("yield: %d fibers, %ld yields in %.0f ms, %.1f M switches/s\n", n_fibers, count.load(), s * 1000,
+			2.0 * count.load() / s / 1e6);
+		ok = (count.load() == (long)n_fibers * yields) && ok;
+	}
+
+	{
+		const int rounds = 100000;
+		Event ping, pong;
+		auto start = clock::now();
+		auto a = scheduler.spawn([&]() {
+			for (int k = 0; k < rounds; ++k) {
+				ping.set();
+				pong.wait();
+			}
+		});
+		std::atomic<int> received{ 0 };
+		auto b = scheduler.spawn([&]() {
+			for (int k = 0; k < rounds; ++k) {
+				ping.wait();
+				received.fetch_add(1, std::memory_order_relaxed);
+				pong.set();
+			}
+		});
+		a->join();
+		b->join();
+		double s = std::chrono::duration<double>(clock::now() - start).count();
+		std::printf("event ping-pong: %d rounds in %.0f ms, %.2f us per round trip\n", rounds, s * 1000, s * 1e6 / rounds);
+		ok = (received.load() == rounds) && ok;
+	}
+
+	std::printf(ok ? "ok\n" : "failed\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+// latest_value: a polling reader never sees a torn value or an older one than it had, and always ends with the last
+// one published; readers blocked in wait() are never left asleep with a value pending (ping-pong and bursts).
+//	g++ -std=c++17 -O2 -I.. -I<logger.h dir> latest_value_wait.cpp -pthread
+#include "../LatestValue.h"
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+struct Quote {
+	uint64_t v[16];
+};
+
+static bool check(bool ok, const char* what)
+{
+	if (!ok)
+		std::printf("failed: %s\n", what);
+	return ok;
+}
+
+// a lost wakeup shows as a hang: fail instead once 'progress' stops moving
+class Watchdog {
+	std::atomic<uint64_t>& progress;
+	std::atomic<bool> stopping{ false };
+	std::thread thread;
+public:
+	Watchdog(std::atomic<uint64_t>& p, const char* what) : progress(p), thread([this, what]() {
+		uint64_t last = progress.load();
+		for (int idle_ms = 0; !stopping.load(); ) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			uint64_t now = progress.load();
+			idle_ms = (now == last) ? idle_ms + 10 : 0;
+			last = now;
+			if (idle_ms >= 5000) {
+				std::printf("failed: %s stalled at %llu\n", what, (unsigned long long)now);
+				std::_Exit(1);
+			}
+		}
+	}) {}
+	~Watchdog() {
+		stopping.store(true);
+		thread.join();
+	}
+};
+
+int main()
+{
+	bool ok = true;
+
+	{
+		const uint64_t n = 2000000;
+		latest_value<Quote> box;
+		std::atomic<bool> done{ false };
+		uint64_t torn = 0, backwards = 0, reads = 0, last = 0;
+		std::thread reader([&]() {
+			while (true) {
+				bool finished = done.load();
+				if (box.refresh()) {
+					const Quote& q = box.value();
+					for (int i = 1; i < 16; ++i)
+						torn += (q.v[i] != q.v[0]) ? 1 : 0;
+					backwards += (q.v[0] < last) ? 1 : 0;
+					last = q.v[0];
+					++reads;
+				}
+				else if (finished)
+					return;
+			}
+		});
+		Quote q;
+		for (uint64_t k = 1; k <= n; ++k) {
+			for (auto& x : q.v)
+				x = k;
+			box.publish(q);
+			// let the reader in, even on a single core
+			if (0 == k % 64)
+				std::this_thread::yield();
+		}
+		done.store(true);
+		reader.join();
+		std::printf("polling: %llu published, %llu read, %llu torn, %llu backwards, last %llu\n", (unsigned long long)box.written(),
+			(unsigned long long)reads, (unsigned long long)torn, (unsigned long long)backwards, (unsigned long long)last);
+		ok = check(0 == torn && 0 == backwards, "values are never torn nor older than the previous one") && ok;
+		ok = check(n == last && reads == box.consumed(), "the reader ends with the last value") && ok;
+	}
+
+	{
+		// each side waits for the other's value: a single lost wakeup stalls both
+		const uint64_t rounds = 50000;
+		latest_value<uint64_t> ping(0), pong(0);
+		std::atomic<uint64_t> progress{ 0 };
+		Watchdog dog(progress, "ping-pong");
+		std::thread other([&]() {
+			for (uint64_t k = 1; k <= rounds; ++k) {
+				uint64_t v = ping.wait();
+				pong.publish(v);
+			}
+		});
+		bool in_order = true;
+		for (uint64_t k = 1; k <= rounds; ++k) {
+			ping.publish(k);
+			in_order = (pong.wait() == k) && in_order;
+			progress.store(k);
+		}
+		other.join();
+		std::printf("ping-pong: %llu rounds, %llu values taken\n", (unsigned long long)rounds, (unsigned long long)ping.consumed());
+		ok = check(in_order && rounds == ping.consumed() && rounds == pong.consumed(), "every value sent is the one received") && ok;
+	}
+
+	{
+		// bursts with pauses: a reader asleep in wait() wakes up for each burst and sees the end of the last one
+		const int bursts = 200;
+		const int burst = 100;
+		latest_value<int> box(0);
+		std::atomic<uint64_t> progress{ 0 };
+		Watchdog dog(progress, "bursts");
+		int last = 0, backwards = 0;
+		std::thread reader([&]() {
+			while (last != bursts * burst) {
+				int v = box.wait();
+				backwards += (v <= last) ? 1 : 0;
+				last = v;
+				progress.fetch_add(1);
+			}
+		});
+		for (int b = 0; b < bursts; ++b) {
+			for (int i = 1; i <= burst; ++i)
+				box.publish(b * burst + i);
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+		reader.join();
+		std::printf("bursts: %llu published, %llu taken, last %d\n", (unsigned long long)box.written(), (unsigned long long)box.consumed(), last);
+		ok = check(0 == backwards && bursts * burst == last, "wait() returns newer values only, up to the last one") && ok;
+	}
+
+	{
+		latest_value<int> box(0);
+		ok = check(!box.wait_for(std::chrono::milliseconds(20)), "wait_for times out when nothing is published") && ok;
+		std::thread writer([&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			box.publish(7);
+		});
+		ok = check(box.wait_for(std::chrono::seconds(5)) && 7 == box.value(), "wait_for takes a value published while it waits") && ok;
+		writer.join();
+	}
+
+	std::printf(ok ? "ok\n" : "failed\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+// Pipeline item counts and ordering: every pushed item reaches the sink once and in order, with a slow stage causing
+// backpressure upstream and idle waits downstream, or a slow producer leaving every stage idle; a throwing item is
+// counted as a failure and dropped alone.
+//	g++ -std=c++17 -O2 -I.. -I<logger.h dir> pipeline_stages.cpp -pthread
+#include "../Pipeline.h"
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static bool check(bool ok, const char* what)
+{
+	if (!ok)
+		std::printf("failed: %s\n", what);
+	return ok;
+}
+
+static void show(const char* name, const Threading::Pipeline<int>& p)
+{
+	for (size_t i = 0; i < p.stage_count(); ++i) {
+		const Threading::StageStats& s = p.stats(i);
+		std::printf("%s stage %zu: %llu items, %llu batches, %llu idle waits, %llu full waits, %llu wakeups, %llu failures, peak %zu/%zu\n",
+			name, i, (unsigned long long)s.items.load(), (unsigned long long)s.batches.load(), (unsigned long long)s.idle_waits.load(),
+			(unsigned long long)s.full_waits.load(), (unsigned long long)s.wakeups.load(), (unsigned long long)s.failures.load(),
+			s.peak_occupancy.load(), p.capacity(i));
+	}
+}
+
+// waits for the sink to get 'n' items, so that the stats can be read before the pipeline is destroyed
+static void drain(const std::atomic<int>& received, int n)
+{
+	while (received.load() < n)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+int main()
+{
+	using namespace Threading;
+	bool ok = true;
+	SafeThread::ExceptionHandler quiet([](SafeThread&, tracked_exception&) { return true; });
+
+	{
+		// slow middle stage: the first stage blocks on its full output, the sink waits for data
+		const int n = 3000;
+		const int bad = 777;
+		std::vector<int> seen;
+		std::atomic<int> received{ 0 };
+		auto p = PipelineBuilder<int>(16, 4, quiet)
+			.stage(L"check", [](int x) {
+				if (bad == x)
+					throw std::runtime_error("bad item");
+				return x;
+			})
+			.stage(L"slow", [](int x) {
+				if (0 == x % 100)
+					std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				return x;
+			})
+			.sink(L"collect", [&](int x) {
+				seen.push_back(x);
+				received.fetch_add(1);
+			});
+		for (int i = 0; i < n; ++i)
+			p.push(i);
+		p.close();
+		drain(received, n - 1);
+		show("slow stage", p);
+
+		bool ordered = (int)seen.size() == n - 1;
+		for (int i = 0, k = 0; ordered && i < n; ++i) {
+			if (bad != i)
+				ordered = seen[k++] == i;
+		}
+		ok = check(ordered, "every item but the failed one reaches the sink, in order") && ok;
+		ok = check(n == (int)p.stats(0).items && 1 == p.stats(0).failures, "the first stage takes every item, one fails") && ok;
+		ok = check(n - 1 == (int)p.stats(1).items && n - 1 == (int)p.stats(2).items && 0 == p.stats(1).failures + p.stats(2).failures,
+			"the next stages take every item left") && ok;
+		ok = check(p.stats(1).full_waits > 0, "the slow stage pushes back on the one feeding it") && ok;
+		ok = check(p.stats(2).idle_waits > 0, "the stage after the slow one waits for data") && ok;
+		ok = check(p.stats(1).peak_occupancy <= p.capacity(1), "the occupancy stays within capacity") && ok;
+	}
+
+	{
+		// slow producer: every stage drains its input and sleeps, then is woken up by the next item
+		const int n = 200;
+		std::vector<int> seen;
+		std::atomic<int> received{ 0 };
+		auto p = PipelineBuilder<int>(64, 16, quiet)
+			.stage(L"square", [](int x) { return x * x; })
+			.sink(L"collect", [&](int x) {
+				seen.push_back(x);
+				received.fetch_add(1);
+			});
+		for (int i = 0; i < n; ++i) {
+			p.push(i);
+			if (0 == i % 10)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		p.close();
+		drain(received, n);
+		show("slow producer", p);
+
+		bool ordered = (int)seen.size() == n;
+		for (int i = 0; ordered && i < n; ++i)
+			ordered = seen[i] == i * i;
+		ok = check(ordered, "every item reaches the sink, in order") && ok;
+		ok = check(n == (int)p.stats(0).items && n == (int)p.stats(1).items, "each stage takes every item once") && ok;
+		ok = check(p.stats(0).idle_waits > 0 && p.stats(1).idle_waits > 0, "idle stages sleep") && ok;
+		// a flush racing with the stage going to sleep may wake it once without a sleep, not once per flush
+		ok = check(p.stats(0).wakeups > 0 && p.stats(0).wakeups <= 2 * p.stats(0).idle_waits, "a sleeping stage is woken up once, not once per item") && ok;
+		ok = check(0 == p.stats(0).full_waits, "a slow producer never meets backpressure") && ok;
+	}
+
+	std::printf(ok ? "ok\n" : "failed\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+// rcu_ref reclamation: a version stays alive and unchanged while a snapshot, even a nested one, holds it and is freed
+// once released; synchronize() waits for open readers; readers racing with writers never see a freed version.
+//	g++ -std=c++17 -O2 -I.. -I<logger.h dir> rcu_reclaim.cpp -pthread
+#include "../SafeThread.h"
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+static const int alive_magic = 0x600dcafe;
+static std::atomic<int> live{ 0 };
+
+struct Version {
+	int id;
+	int check;	// -id, torn or freed otherwise
+	int alive{ alive_magic };
+	explicit Version(int _id) : id(_id), check(-_id) { live.fetch_add(1); }
+	Version(const Version& v) : id(v.id), check(v.check) { live.fetch_add(1); }
+	~Version() {
+		alive = 0;
+		live.fetch_sub(1);
+	}
+	bool valid() const { return alive == alive_magic && check == -id; }
+};
+
+static bool check(bool ok, const char* what)
+{
+	if (!ok)
+		std::printf("failed: %s\n", what);
+	return ok;
+}
+
+int main()
+{
+	bool ok = true;
+	Rcu::Domain& domain = Rcu::Domain::inst();
+
+	{
+		// a reader holding version 0 pins it, and what was retired after it, until it lets go
+		rcu_ref<Version> ref(std::in_place, 0);
+		std::atomic<int> step{ 0 };
+		std::atomic<bool> held_valid{ true };
+		std::thread reader([&]() {
+			auto s = ref.read();
+			{
+				auto nested = ref.read();
+			}
+			step.store(1);
+			while (step.load() != 2)
+				std::this_thread::yield();
+			held_valid.store(s->valid() && 0 == s->id);
+		});
+		while (step.load() != 1)
+			std::this_thread::yield();
+		for (int i = 1; i <= 10; ++i)
+			ref.publish(std::make_unique<Version>(i));
+		ok = check(11 == live.load() && 10 == domain.pending(), "versions retired while a snapshot is held stay alive") && ok;
+		step.store(2);
+		reader.join();
+		ok = check(held_valid.load(), "a held snapshot is unchanged") && ok;
+		domain.reclaim();
+		ok = check(1 == live.load() && 0 == domain.pending(), "released versions are freed") && ok;
+	}
+	ok = check(0 == live.load(), "the rcu_ref frees its last version") && ok;
+
+	{
+		// synchronize() returns only once the read section open at the call is over
+		rcu_ref<Version> ref(std::in_place, 0);
+		std::atomic<bool> reading{ false };
+		std::thread reader([&]() {
+			auto s = ref.read();
+			reading.store(true);
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		});
+		while (!reading.load())
+			std::this_thread::yield();
+		auto start = std::chrono::steady_clock::now();
+		domain.synchronize();
+		ok = check(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(40), "synchronize() waits for open readers") && ok;
+		reader.join();
+	}
+
+	{
+		// readers racing with publish() and update(): every snapshot is a live, consistent version
+		const int readers = 4;
+		const int versions = 20000;
+		rcu_ref<Version> ref(std::in_place, 0);
+		std::atomic<bool> stopping{ false };
+		std::atomic<long> reads{ 0 }, bad{ 0 };
+		int peak = 0;
+		std::vector<std::thread> threads;
+		for (int i = 0; i < readers; ++i) {
+			threads.emplace_back([&]() {
+				while (!stopping.load(std::memory_order_relaxed)) {
+					auto s = ref.read();
+					int id = s->id;
+					std::this_thread::yield();
+					if (!s->valid() || s->id != id)
+						bad.fetch_add(1);
+					reads.fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+		}
+		for (int i = 1; i <= versions; ++i) {
+			if (i % 2)
+				ref.publish(std::make_unique<Version>(i));
+			else
+				ref.update([](Version& v) { v.id++; v.check--; });
+			peak = std::max(peak, live.load());
+			// let the readers in, even on a single core
+			if (0 == i % 16)
+				std::this_thread::yield();
+		}
+		stopping.store(true);
+		for (auto& t : threads)
+			t.join();
+		domain.synchronize();
+		std::printf("%d readers, %ld reads, %d versions published, %ld bad, at most %d versions alive, then %d live, %zu pending\n",
+			readers, reads.load(), versions, bad.load(), peak, live.load(), domain.pending());
+		ok = check(0 == bad.load(), "readers only see live, consistent versions") && ok;
+		ok = check(1 == live.load() && 0 == domain.pending(), "every replaced version is freed once the readers are gone") && ok;
+	}
+
+	std::printf(ok ? "ok\n" : "failed\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+// Shared events across processes: an auto-reset set() wakes one process, a manual-reset one wakes them all, wait_for
+// times out, and a segment left unpublished by a creator that died is taken over by the next process opening the name.
+//	g++ -std=c++17 -O2 -I.. shared_event_fork.cpp -pthread -lrt
+#include "../SharedEvent.h"
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <cstdio>
+#include <vector>
+#include <functional>
+
+static std::string unique_name(const char* what)
+{
+	return std::string("/shared_event_test_") + what + "_" + std::to_string(getpid());
+}
+
+// runs 'child' in a forked process, whose exit code is what it returns
+static pid_t spawn(const std::function<int()>& child)
+{
+	pid_t pid = fork();
+	if (0 == pid)
+		_exit(child());
+	return pid;
+}
+
+static int exit_code(pid_t pid)
+{
+	int status = 0;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static bool check(bool ok, const char* what)
+{
+	if (!ok)
+		std::printf("failed: %s\n", what);
+	return ok;
+}
+
+// each child waits up to 'timeout' and exits with 1 if it got the event
+static std::vector<pid_t> spawn_waiters(const std::string& name, bool manual, int n, std::chrono::milliseconds timeout)
+{
+	std::vector<pid_t> pids;
+	for (int i = 0; i < n; ++i) {
+		pids.push_back(spawn([&]() {
+			if (manual) {
+				SingleSharedEvent ev(name);
+				return ev.wait_for(timeout) ? 1 : 0;
+			}
+			SharedEvent ev(name);
+			return ev.wait_for(timeout) ? 1 : 0;
+		}));
+	}
+	return pids;
+}
+
+static int woken(const std::vector<pid_t>& pids)
+{
+	int n = 0;
+	for (pid_t pid : pids)
+		n += exit_code(pid);
+	return n;
+}
+
+int main()
+{
+	bool ok = true;
+
+	{
+		std::string name = unique_name("auto");
+		SharedEvent ev(name);
+		auto pids = spawn_waiters(name, false, 3, std::chrono::milliseconds(1000));
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		ev.set();
+		ok = check(1 == woken(pids), "an auto-reset set() wakes exactly one process") && ok;
+		ok = check(!ev.is_set(), "the woken process consumed the signal") && ok;
+		SingleSharedEvent::unlink(name);
+	}
+
+	{
+		std::string name = unique_name("manual");
+		SingleSharedEvent ev(name);
+		auto pids = spawn_waiters(name, true, 3, std::chrono::milliseconds(1000));
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		ev.set();
+		ok = check(3 == woken(pids), "a manual-reset set() wakes every process") && ok;
+		ok = check(ev.is_set(), "a manual-reset event stays set") && ok;
+		SingleSharedEvent::unlink(name);
+	}
+
+	{
+		std::string name = unique_name("timeout");
+		SharedEvent ev(name);
+		auto start = std::chrono::steady_clock::now();
+		auto pids = spawn_waiters(name, false, 1, std::chrono::milliseconds(50));
+		ok = check(0 == woken(pids), "wait_for returns false when nothing is set") && ok;
+		auto elapsed = std::chrono::steady_clock::now() - start;
+		ok = check(elapsed >= std::chrono::milliseconds(50) && elapsed < std::chrono::milliseconds(500), "wait_for lasts its timeout") && ok;
+		SingleSharedEvent::unlink(name);
+	}
+
+	{
+		// a creator that died right after creating the name, before sizing the segment
+		std::string name = unique_name("stale");
+		pid_t creator = spawn([&]() {
+			int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+			flock(fd, LOCK_EX);
+			return fd < 0 ? 1 : 0;
+		});
+		ok = check(0 == exit_code(creator), "stale segment created") && ok;
+		auto start = std::chrono::steady_clock::now();
+		SharedEvent ev(name);
+		ok = check((bool)ev && std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100), "a stale segment is taken over") && ok;
+		auto pids = spawn_waiters(name, false, 1, std::chrono::milliseconds(1000));
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		ev.set();
+		ok = check(1 == woken(pids), "a taken over event works across processes") && ok;
+		SingleSharedEvent::unlink(name);
+	}
+
+	std::printf(ok ? "ok\n" : "failed\n");
+	return ok ? 0 : 1;
+}
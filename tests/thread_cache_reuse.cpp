@@ -0,0 +1,97 @@
+// ThreadCache: joined SafeThreads give their OS thread to the next launches, and a job finds the library's thread_local
+// state reset even when the previous job on that thread died from a fault inside a read section; user thread_local
+// objects live on.
+//	g++ -std=c++17 -O2 -I.. -I<logger.h dir> thread_cache_reuse.cpp -pthread
+#include "../SafeThread.h"
+#include <cstdio>
+#include <thread>
+
+using namespace Threading;
+
+static volatile int* volatile nullp = nullptr;
+static thread_local int user_jobs = 0;
+
+static bool check(bool ok, const char* what)
+{
+	if (!ok)
+		std::printf("failed: %s\n", what);
+	return ok;
+}
+
+int main()
+{
+	bool ok = true;
+	ThreadCache::enable();
+	ThreadCache::inst().configure(8, std::chrono::milliseconds(10000));
+	std::atomic<int> faults{ 0 };
+	SafeThread::ExceptionHandler count_faults([&](SafeThread&, tracked_exception&) {
+		faults.fetch_add(1);
+		return false;
+	});
+
+	// warm up: one thread in the cache
+	{
+		SafeThread t([]() {});
+	}
+	ThreadCache::Stats before = ThreadCache::inst().stats();
+
+	std::thread::id first;
+	int seen_jobs = -1;
+	{
+		SafeThread t([&]() {
+			first = std::this_thread::get_id();
+			++user_jobs;
+		});
+	}
+	{
+		SafeThread t([&]() {
+			if (std::this_thread::get_id() == first)
+				seen_jobs = user_jobs++;
+		});
+	}
+	ThreadCache::Stats after = ThreadCache::inst().stats();
+	std::printf("created %llu then %llu, reused %llu then %llu, %zu idle\n", (unsigned long long)before.created,
+		(unsigned long long)after.created, (unsigned long long)before.reused, (unsigned long long)after.reused, after.idle);
+	ok = check(after.created == before.created && after.reused == before.reused + 2 && 1 == after.idle, "sequential launches reuse the cached thread") && ok;
+	ok = check(1 == seen_jobs, "user thread_local objects live on between jobs") && ok;
+
+	{
+		// a job dies from a fault while holding a snapshot: its read section must not outlive it
+		rcu_ref<int> ref(std::in_place, 0);
+		Rcu::Domain& domain = Rcu::Domain::inst();
+		{
+			SafeThread t(count_faults, [&]() {
+				auto s = ref.read();
+				*nullp = *s;
+			});
+		}
+		ref.publish(std::make_unique<int>(1));
+		ok = check(1 == faults.load() && 0 == domain.pending(), "a fault in a read section does not pin reclamation for the next jobs") && ok;
+
+		// the next job on the same thread reads, nests and faults again like on a fresh thread
+		bool same_thread = false, reads_ok = false;
+		{
+			SafeThread t(count_faults, [&]() {
+				same_thread = std::this_thread::get_id() == first;
+				{
+					auto outer = ref.read();
+					auto inner = ref.read();
+					reads_ok = 1 == *outer && 1 == *inner;
+				}
+				*nullp = 1;
+			});
+		}
+		ref.publish(std::make_unique<int>(2));
+		ok = check(same_thread && reads_ok, "a job after a faulted one reads normally") && ok;
+		ok = check(2 == faults.load() && 0 == domain.pending(), "a fault on a reused thread is caught and leaves no reader behind") && ok;
+	}
+
+	{
+		SafeThread t([&]() { seen_jobs = user_jobs; });
+	}
+	ok = check(2 == seen_jobs, "faulted jobs leave the thread in the cache") && ok;
+	ok = check(ThreadCache::inst().stats().created == before.created, "no thread was created after the warm up") && ok;
+
+	std::printf(ok ? "ok\n" : "failed\n");
+	return ok ? 0 : 1;
+}